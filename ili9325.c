@@ -5,12 +5,17 @@
  * Copyright 2020 Noralf Trønnes
  */
 
+#include <linux/atomic.h>
+#include <linux/completion.h>
 #include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/dma-buf.h>
 #include <linux/dma-mapping.h>
 #include <linux/gpio/consumer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/property.h>
 #include <linux/regmap.h>
 #include <linux/spi/spi.h>
@@ -34,6 +39,109 @@
 #include <drm/drm_simple_kms_helper.h>
 #include <drm/drm_vblank.h>
 
+#include "tinydrm-helpers.h"
+#include "tinydrm-trace.h"
+
+/*
+ * Every register access is a chip select cycle of its own: start byte
+ * followed by a big endian 16-bit index or value. A batch queues several
+ * of these as transfers with cs_change set in between so they go out in
+ * one spi_message.
+ */
+#define ILI9325_BATCH_MAX	16
+
+/*
+ * Registers go through a regmap with a flat cache. It uses cmd_lock instead of
+ * its own lock since pixel flushes set the window outside of regmap in the
+ * same message as the pixels.
+ */
+#define ILI9325_MAX_REG		0xff
+
+/* GRAM window, horizontal and vertical start/end, followed by the cursor */
+static const u16 ili9325_window_regs[] = { 0x50, 0x51, 0x52, 0x53, 0x20, 0x21 };
+
+#define ILI9325_NUM_WINDOW_REGS	4
+
+/* DMA safe buffers shared by all register accesses, protected by cmd_lock */
+/* Entry mode (R03h) bits that place the framebuffer in GRAM */
+#define ILI9325_ENTRY_ID1	BIT(5)
+#define ILI9325_ENTRY_ID0	BIT(4)
+#define ILI9325_ENTRY_AM	BIT(3)
+
+#define ILI9325_CMD_BUF_SIZE	(ILI9325_BATCH_MAX * 3)
+#define ILI9325_RX_BUF_SIZE	4
+
+struct ili9325_batch {
+	struct spi_message m;
+	struct spi_transfer tr[ILI9325_BATCH_MAX];
+	unsigned int num;
+	u32 speed_hz;
+	u8 *buf;
+};
+
+/*
+ * Pixel data is flushed asynchronously through a ring of transmit buffers so
+ * the next buffer can be filled while the previous one is still on the bus.
+ * Each buffer is sent as an optional window setup message followed by the
+ * pixel data message.
+ *
+ * The messages of a buffer are kept and resubmitted as long as the window,
+ * length and clock stay the same, which is the common case for full frame
+ * and stripe flushes. Building them again is skipped, but the SPI core in
+ * this kernel still validates and DMA maps each message on submit: premapped
+ * buffers (is_dma_mapped) can't be used since controllers like spi-bcm2835
+ * rely on the scatterlists the core sets up when mapping.
+ *
+ * By default there are two buffers each holding a full frame. In stripe mode
+ * the damaged rectangle is split into stripes of a few lines that are
+ * converted and sent one at a time through a ring of small buffers. This
+ * lowers the latency until the first pixel goes out and the memory used.
+ */
+#define ILI9325_NUM_FRAME_BUFS	2
+#define ILI9325_NUM_STRIPE_BUFS	3
+
+/*
+ * A rectangle costs the 39 bytes of window setup plus the latency of two more
+ * messages in addition to its pixels.
+ */
+#define ILI9325_DAMAGE_SETUP_COST	128
+
+/*
+ * Frames without damage end with the buffer that is already on the bus, keep
+ * the post time of a few of them for the latency statistics.
+ */
+#define ILI9325_TXBUF_FRAMES	8
+
+struct tinydrm_ili9325;
+
+struct ili9325_txbuf {
+	struct tinydrm_ili9325 *ili9325;
+	struct ili9325_batch batch;
+	struct spi_message *msgs;
+	struct spi_transfer *trs;
+	unsigned int max_chunks;
+	unsigned int num_submitted;
+	atomic_t pending;
+	struct completion done;
+	u8 *cmd_buf;
+	void *buf;
+	int status;
+	/* Page flip events sent when the buffer has gone out, under frame_lock */
+	struct list_head events;
+	/* Post times of the frames that end with this buffer, under frame_lock */
+	ktime_t frame_posted[ILI9325_TXBUF_FRAMES];
+	unsigned int num_frames;
+
+	bool prepared;
+	bool prep_window;
+	bool prep_window_cached;
+	struct drm_rect prep_rect;
+	const void *prep_buf;
+	size_t prep_len;
+	u32 prep_speed_hz;
+	unsigned int prep_num_msgs;
+};
+
 struct tinydrm_ili9325 {
 	struct drm_device drm;
 	struct drm_simple_display_pipe pipe;
@@ -42,10 +150,58 @@ struct tinydrm_ili9325 {
 	struct spi_device *spi;
 	unsigned int devcode;
 	bool enabled;
-	void *tx_buf;
+	/* Controller registers hold the init sequence, kept while disabled */
+	bool initialized;
+	/* Leave the bootloader splash on until the first update */
+	bool keep_splash;
+	struct ili9325_txbuf *txbufs;
+	unsigned int num_txbufs;
+	unsigned int next_txbuf;
+	struct ili9325_txbuf *last_txbuf;
+	spinlock_t frame_lock;
+	/* Buffers on the bus and when the bus got busy, under frame_lock */
+	unsigned int bus_busy;
+	ktime_t bus_start;
+	unsigned int stripe_height;
+	u32 pixel_speed_hz;
+	u32 first_byte_us;
+	u32 enable_us;
+	struct tinydrm_damage damage;
+	struct tinydrm_mailbox mbox;
+	void *shadow;
+	void *diff_buf;
+	bool shadow_valid;
+	u64 shadow_flushes;
+	u64 shadow_identical;
+	u64 shadow_damaged;
+	u64 shadow_flushed;
+	/*
+	 * Hardware vertical scroll: GRAM lines are a ring that is displayed
+	 * starting at line @vscroll. Only possible when our init sequence has
+	 * enabled it, so not for a panel adopted from the bootloader.
+	 */
+	bool vscroll_enabled;
+	bool vscroll_ok;
+	unsigned int vscroll;
+	void *frame_buf;
+	u64 scrolls;
+	u64 scroll_lines;
+	u64 convert_ns;
+	u64 convert_bytes;
 	bool swap_bytes;
 	unsigned int rotation;
-	unsigned int set_win_type;
+	/* Entry mode of each rotation and the one in use, 0 if unknown */
+	const u16 *entry_modes;
+	u16 entry_mode;
+	struct mutex cmd_lock;
+	struct regmap *regmap;
+	u8 *cmd_buf;
+	u8 *rx_buf;
+	void *line_buf;
+	u32 num_msgs;
+	u32 flush_msgs;
+	u64 prepared_hits;
+	u64 prepared_misses;
 	struct gpio_desc *reset;
 	struct backlight_device *backlight;
 	struct regulator *regulator;
@@ -63,277 +219,1543 @@ static u8 ili9325_get_startbyte(bool id, bool rs, bool read)
 	return 0x70 | (id << 2) | (rs << 1) | read;
 }
 
-static int ili9325_spi_transfer(struct tinydrm_ili9325 *ili9325,
-				u8 startbyte, const void *buf, size_t len)
+static int ili9325_spi_sync(struct tinydrm_ili9325 *ili9325, struct spi_message *m)
 {
-	struct spi_device *spi = ili9325->spi;
-	/* For reliability only run pixel data above spec */
-	u32 norm_speed_hz = min_t(u32, 10000000, spi->max_speed_hz);
-	struct spi_transfer header = {
-		.speed_hz = norm_speed_hz,
-		.bits_per_word = 8,
-		.len = 1,
-	};
-	struct spi_transfer tr = {
-		.bits_per_word = 16,
-	};
-	struct spi_message m;
-	size_t max_chunk;
-	u8 *startbytebuf;
-	size_t chunk;
-	int ret = 0;
-
-	if (len <= 64)
-		tr.speed_hz = norm_speed_hz;
-
-	/* Bytes have already been swapped if necessary */
-	if (!spi_is_bpw_supported(ili9325->spi, 16))
-		tr.bits_per_word = 8;
-
-	startbytebuf = kmalloc(1, GFP_KERNEL);
-	if (!startbytebuf)
-		return -ENOMEM;
+	ili9325->num_msgs++;
 
-	header.tx_buf = startbytebuf;
-	*startbytebuf = startbyte;
+	return spi_sync(ili9325->spi, m);
+}
 
-	max_chunk = spi_max_transfer_size(spi);
+/* For reliability only run pixel data above spec */
+static u32 ili9325_safe_speed(struct tinydrm_ili9325 *ili9325)
+{
+	return min_t(u32, 10000000, ili9325->spi->max_speed_hz);
+}
 
-	spi_message_init(&m);
-	spi_message_add_tail(&header, &m);
-	spi_message_add_tail(&tr, &m);
+/* GRAM and register reads are slower than writes */
+static u32 ili9325_read_speed(struct tinydrm_ili9325 *ili9325)
+{
+	return min_t(u32, 5000000, ili9325->spi->max_speed_hz / 2);
+}
 
-	while (len) {
-		chunk = min(len, max_chunk);
+static void ili9325_batch_init(struct tinydrm_ili9325 *ili9325,
+			       struct ili9325_batch *batch, u8 *buf)
+{
+	batch->buf = buf;
+	batch->num = 0;
+	batch->speed_hz = ili9325_safe_speed(ili9325);
+	spi_message_init(&batch->m);
+}
 
-		tr.tx_buf = buf;
-		tr.len = chunk;
+static void ili9325_batch_add(struct ili9325_batch *batch, bool rs, u16 val)
+{
+	struct spi_transfer *tr = &batch->tr[batch->num];
+	u8 *buf = &batch->buf[batch->num * 3];
 
-		ret = spi_sync(spi, &m);
-		if (ret)
-			goto err_free;
+	if (WARN_ON_ONCE(batch->num == ILI9325_BATCH_MAX))
+		return;
 
-		buf += chunk;
-		len -= chunk;
-	}
+	buf[0] = ili9325_get_startbyte(0, rs, 0);
+	put_unaligned_be16(val, &buf[1]);
 
-err_free:
-	kfree(startbytebuf);
+	*tr = (struct spi_transfer) {
+		.tx_buf = buf,
+		.len = 3,
+		.bits_per_word = 8,
+		.speed_hz = batch->speed_hz,
+		.cs_change = 1,
+	};
+	spi_message_add_tail(tr, &batch->m);
+	batch->num++;
+}
 
-	return ret;
+static void ili9325_batch_index(struct ili9325_batch *batch, u16 index)
+{
+	ili9325_batch_add(batch, 0, index);
 }
 
-static int ili9325_write_index(struct tinydrm_ili9325 *ili9325, u16 index)
+static void ili9325_batch_write(struct ili9325_batch *batch, u16 reg, u16 val)
 {
-	u8 startbyte;
-	u16 *buf;
-	int ret;
+	ili9325_batch_add(batch, 0, reg);
+	ili9325_batch_add(batch, 1, val);
+}
 
-	buf = kmalloc(sizeof(*buf), GFP_KERNEL);
-	if (!buf)
-		return -ENOMEM;
+static void ili9325_batch_finish(struct ili9325_batch *batch)
+{
+	/* cs_change on the last transfer would keep CS asserted */
+	if (batch->num)
+		batch->tr[batch->num - 1].cs_change = 0;
+}
 
-	if (ili9325->swap_bytes)
-		*buf = swab16(index);
-	else
-		*buf = index;
+static int ili9325_batch_sync(struct tinydrm_ili9325 *ili9325,
+			      struct ili9325_batch *batch)
+{
+	if (!batch->num)
+		return 0;
 
-	startbyte = ili9325_get_startbyte(0, 0, 0);
-	ret = ili9325_spi_transfer(ili9325, startbyte, buf, sizeof(*buf));
-	kfree(buf);
+	ili9325_batch_finish(batch);
 
-	return ret;
+	return ili9325_spi_sync(ili9325, &batch->m);
 }
 
-static int ili9325_writebuf(struct tinydrm_ili9325 *ili9325, u16 reg,
-			    const void *buf, size_t len)
+static int ili9325_write_index(struct tinydrm_ili9325 *ili9325, u16 index)
 {
-	u8 startbyte;
-	int ret;
+	struct ili9325_batch batch;
 
-	ret = ili9325_write_index(ili9325, reg);
-	if (ret)
-		return ret;
+	lockdep_assert_held(&ili9325->cmd_lock);
+
+	ili9325_batch_init(ili9325, &batch, ili9325->cmd_buf);
+	ili9325_batch_index(&batch, index);
 
-	startbyte = ili9325_get_startbyte(0, 1, 0);
-	return ili9325_spi_transfer(ili9325, startbyte, buf, len);
+	return ili9325_batch_sync(ili9325, &batch);
 }
 
-static int ili9325_write(struct tinydrm_ili9325 *ili9325, u16 reg, u16 val)
+static int ili9325_regmap_write(void *context, unsigned int reg, unsigned int val)
 {
-	u16 *buf;
-	int ret;
-
-	buf = kmalloc(sizeof(*buf), GFP_KERNEL);
-	if (!buf)
-		return -ENOMEM;
+	struct tinydrm_ili9325 *ili9325 = context;
+	struct ili9325_batch batch;
 
-	if (ili9325->swap_bytes)
-		*buf = swab16(val);
-	else
-		*buf = val;
+	lockdep_assert_held(&ili9325->cmd_lock);
 
-	ret = ili9325_writebuf(ili9325, reg, buf, sizeof(*buf));
-	kfree(buf);
+	ili9325_batch_init(ili9325, &batch, ili9325->cmd_buf);
+	ili9325_batch_write(&batch, reg, val);
 
-	return ret;
+	return ili9325_batch_sync(ili9325, &batch);
 }
 
-static int ili9325_read(struct tinydrm_ili9325 *ili9325, u16 reg, u16 *val)
+static int ili9325_regmap_read(void *context, unsigned int reg, unsigned int *val)
 {
-	struct spi_device *spi = ili9325->spi;
-	u32 speed_hz = min_t(u32, 5000000, spi->max_speed_hz / 2);
+	struct tinydrm_ili9325 *ili9325 = context;
+	u32 speed_hz = ili9325_read_speed(ili9325);
 	struct spi_transfer header = {
+		.tx_buf = ili9325->cmd_buf,
 		.speed_hz = speed_hz,
 		.bits_per_word = 8,
 		.len = 1,
 	};
 	struct spi_transfer trrx = {
+		.rx_buf = ili9325->rx_buf,
 		.speed_hz = speed_hz,
 		.bits_per_word = 8,
 		.len = 3, /* including dummy byte */
 	};
 	struct spi_message m;
-	u8 *startbytebuf;
 	int ret;
 
-	startbytebuf = kmalloc(header.len, GFP_KERNEL);
-	trrx.rx_buf = kzalloc(trrx.len, GFP_KERNEL);
-	if (!startbytebuf || !trrx.rx_buf) {
-		ret = -ENOMEM;
-		goto err_free;
-	}
-
 	ret = ili9325_write_index(ili9325, reg);
 	if (ret)
-		goto err_free;
+		return ret;
 
-	header.tx_buf = startbytebuf;
-	*startbytebuf = ili9325_get_startbyte(0, 1, true);
+	*ili9325->cmd_buf = ili9325_get_startbyte(0, 1, true);
 	spi_message_init(&m);
 	spi_message_add_tail(&header, &m);
 	spi_message_add_tail(&trrx, &m);
-	ret = spi_sync(spi, &m);
+	ret = ili9325_spi_sync(ili9325, &m);
 	if (ret)
-		goto err_free;
+		return ret;
 
 	/* throw away dummy byte */
-	*val = get_unaligned_be16(trrx.rx_buf + 1);
+	*val = get_unaligned_be16(ili9325->rx_buf + 1);
 
-err_free:
-	kfree(startbytebuf);
-	kfree(trrx.rx_buf);
+	return 0;
+}
+
+static const struct regmap_bus ili9325_regmap_bus = {
+	.reg_write = ili9325_regmap_write,
+	.reg_read = ili9325_regmap_read,
+};
+
+/* Device code on read, start oscillation on write */
+static bool ili9325_volatile_reg(struct device *dev, unsigned int reg)
+{
+	return reg == 0x00 || reg == 0x22;
+}
+
+/* Reading GRAM through the index register would mess up the address counter */
+static bool ili9325_readable_reg(struct device *dev, unsigned int reg)
+{
+	return reg != 0x22;
+}
+
+static const struct regmap_config ili9325_regmap_config = {
+	.reg_bits = 16,
+	.val_bits = 16,
+	.max_register = ILI9325_MAX_REG,
+	.volatile_reg = ili9325_volatile_reg,
+	.readable_reg = ili9325_readable_reg,
+	.cache_type = REGCACHE_FLAT,
+	.disable_locking = true,
+};
+
+static int ili9325_write(struct tinydrm_ili9325 *ili9325, u16 reg, u16 val)
+{
+	int ret;
+
+	mutex_lock(&ili9325->cmd_lock);
+	ret = regmap_write(ili9325->regmap, reg, val);
+	mutex_unlock(&ili9325->cmd_lock);
 
 	return ret;
 }
 
-static int ili9325_rgb565_buf_copy(void *dst, struct drm_framebuffer *fb,
-				   struct drm_rect *clip, bool swap)
+/* Registers are read from the cache except the device code */
+static int ili9325_read(struct tinydrm_ili9325 *ili9325, u16 reg, u16 *val)
 {
-	struct drm_gem_cma_object *cma_obj = drm_fb_cma_get_gem_obj(fb, 0);
-	struct dma_buf_attachment *import_attach = cma_obj->base.import_attach;
-	void *src = cma_obj->vaddr;
-	int ret = 0;
+	unsigned int v;
+	int ret;
 
-	if (import_attach) {
-		ret = dma_buf_begin_cpu_access(import_attach->dmabuf,
-					       DMA_FROM_DEVICE);
-		if (ret)
-			return ret;
+	mutex_lock(&ili9325->cmd_lock);
+	ret = regmap_read(ili9325->regmap, reg, &v);
+	mutex_unlock(&ili9325->cmd_lock);
+	if (!ret)
+		*val = v;
+
+	return ret;
+}
+
+/* Record a register write that went out in a batch */
+static void ili9325_cache_write(struct tinydrm_ili9325 *ili9325, u16 reg, u16 val)
+{
+	regcache_cache_only(ili9325->regmap, true);
+	regmap_write(ili9325->regmap, reg, val);
+	regcache_cache_only(ili9325->regmap, false);
+}
+
+/*
+ * Register values in the order of ili9325_window_regs. The entry mode decides
+ * which framebuffer axis runs along the GRAM lines (AM) and in which
+ * direction the address counters go (I/D), and the window follows.
+ */
+static void ili9325_window_values(struct tinydrm_ili9325 *ili9325,
+				  const struct drm_rect *rect, u16 *vals)
+{
+	u16 entry_mode = ili9325->entry_mode;
+	u16 hsa, hea, vsa, vea, ah, av;
+
+	if (entry_mode & ILI9325_ENTRY_AM) {
+		hsa = rect->y1;
+		hea = rect->y2 - 1;
+		vsa = rect->x1;
+		vea = rect->x2 - 1;
+	} else {
+		hsa = rect->x1;
+		hea = rect->x2 - 1;
+		vsa = rect->y1;
+		vea = rect->y2 - 1;
 	}
 
-	switch (fb->format->format) {
-	case DRM_FORMAT_RGB565:
-		if (swap)
-			drm_fb_swab16(dst, src, fb, clip);
-		else
-			drm_fb_memcpy(dst, src, fb, clip);
-		break;
-	case DRM_FORMAT_XRGB8888:
-		drm_fb_xrgb8888_to_rgb565(dst, src, fb, clip, swap);
-		break;
-	default:
-		return -EINVAL;
+	if (!(entry_mode & ILI9325_ENTRY_ID0)) {
+		swap(hsa, hea);
+		hsa = 239 - hsa;
+		hea = 239 - hea;
 	}
 
-	if (import_attach)
-		ret = dma_buf_end_cpu_access(import_attach->dmabuf,
-					     DMA_FROM_DEVICE);
+	if (!(entry_mode & ILI9325_ENTRY_ID1)) {
+		swap(vsa, vea);
+		vsa = 319 - vsa;
+		vea = 319 - vea;
+	}
+
+	/* Start in the corner the address counters move away from */
+	ah = entry_mode & ILI9325_ENTRY_ID0 ? hsa : hea;
+	av = entry_mode & ILI9325_ENTRY_ID1 ? vsa : vea;
+
+	/* Flushes are split so the window never crosses the end of the ring */
+	vsa = (vsa + ili9325->vscroll) % 320;
+	vea = (vea + ili9325->vscroll) % 320;
+	av = (av + ili9325->vscroll) % 320;
+
+	vals[0] = hsa;
+	vals[1] = hea;
+	vals[2] = vsa;
+	vals[3] = vea;
+	vals[4] = ah;
+	vals[5] = av;
+}
+
+/* The window registers already hold @rect, caller holds cmd_lock */
+static bool ili9325_window_cached(struct tinydrm_ili9325 *ili9325,
+				  const struct drm_rect *rect)
+{
+	u16 vals[ARRAY_SIZE(ili9325_window_regs)];
+	unsigned int i, val;
+
+	ili9325_window_values(ili9325, rect, vals);
+	for (i = 0; i < ILI9325_NUM_WINDOW_REGS; i++) {
+		if (regmap_read(ili9325->regmap, ili9325_window_regs[i], &val) ||
+		    val != vals[i])
+			return false;
+	}
+
+	return true;
+}
+
+/* Record the window registers after @rect has been sent */
+static void ili9325_window_commit(struct tinydrm_ili9325 *ili9325,
+				  const struct drm_rect *rect)
+{
+	u16 vals[ARRAY_SIZE(ili9325_window_regs)];
+	unsigned int i;
+
+	ili9325_window_values(ili9325, rect, vals);
+	for (i = 0; i < ARRAY_SIZE(ili9325_window_regs); i++)
+		ili9325_cache_write(ili9325, ili9325_window_regs[i], vals[i]);
+}
+
+/* A window write may have failed, make sure the next one goes out */
+static void ili9325_window_invalidate(struct tinydrm_ili9325 *ili9325)
+{
+	unsigned int i;
+
+	for (i = 0; i < ILI9325_NUM_WINDOW_REGS; i++)
+		ili9325_cache_write(ili9325, ili9325_window_regs[i], 0xffff);
+}
+
+/*
+ * Set the GRAM window and address, and leave the index at GRAM write (0x22).
+ * The window registers are skipped if @cached, the address always has to be
+ * set since it has moved with the previous pixels.
+ */
+static void ili9325_batch_window(struct tinydrm_ili9325 *ili9325,
+				 struct ili9325_batch *batch,
+				 const struct drm_rect *rect, bool cached)
+{
+	u16 vals[ARRAY_SIZE(ili9325_window_regs)];
+	unsigned int i;
+
+	ili9325_window_values(ili9325, rect, vals);
+	for (i = cached ? ILI9325_NUM_WINDOW_REGS : 0; i < ARRAY_SIZE(ili9325_window_regs); i++)
+		ili9325_batch_write(batch, ili9325_window_regs[i], vals[i]);
+	ili9325_batch_index(batch, 0x22);
+	ili9325_batch_finish(batch);
+}
+
+static int ili9325_window_sync(struct tinydrm_ili9325 *ili9325,
+			       const struct drm_rect *rect)
+{
+	struct ili9325_batch batch;
+	int ret;
+
+	ili9325_batch_init(ili9325, &batch, ili9325->cmd_buf);
+	ili9325_batch_window(ili9325, &batch, rect, ili9325_window_cached(ili9325, rect));
+	ret = ili9325_batch_sync(ili9325, &batch);
+	if (ret)
+		ili9325_window_invalidate(ili9325);
+	else
+		ili9325_window_commit(ili9325, rect);
+
 	return ret;
 }
 
-static void ili9325_fb_dirty(struct drm_framebuffer *fb, struct drm_rect *rect)
+static struct spi_message *ili9325_txbuf_msg(struct ili9325_txbuf *txbuf,
+					     unsigned int i)
 {
-	struct drm_gem_cma_object *cma_obj = drm_fb_cma_get_gem_obj(fb, 0);
-	struct tinydrm_ili9325 *ili9325 = drm_to_ili9325(fb->dev);
-	unsigned int height = drm_rect_height(rect);
-	unsigned int width = drm_rect_width(rect);
-	int idx, ret = 0;
-	bool full;
-	void *tr;
+	if (txbuf->batch.num) {
+		if (!i)
+			return &txbuf->batch.m;
+		i--;
+	}
 
-	if (!ili9325->enabled)
-		return;
+	return &txbuf->msgs[i];
+}
 
-	if (!drm_dev_enter(fb->dev, &idx))
+/*
+ * The frame has left the bus: count that as vblank, which gives the events
+ * the time the pixels actually reached the panel.
+ */
+static void ili9325_send_events(struct tinydrm_ili9325 *ili9325,
+				struct list_head *events)
+{
+	struct drm_crtc *crtc = &ili9325->pipe.crtc;
+	struct drm_pending_vblank_event *e, *tmp;
+	unsigned long flags;
+
+	if (list_empty(events))
 		return;
 
-	full = width == fb->width && height == fb->height;
+	if (!drm_crtc_vblank_get(crtc)) {
+		drm_crtc_handle_vblank(crtc);
+		drm_crtc_vblank_put(crtc);
+	}
 
-	DRM_DEBUG_KMS("Flushing [FB:%d] " DRM_RECT_FMT "\n", fb->base.id, DRM_RECT_ARG(rect));
+	spin_lock_irqsave(&ili9325->drm.event_lock, flags);
+	list_for_each_entry_safe(e, tmp, events, base.link) {
+		list_del(&e->base.link);
+		drm_crtc_send_vblank_event(crtc, e);
+	}
+	spin_unlock_irqrestore(&ili9325->drm.event_lock, flags);
+}
 
-	if (ili9325->swap_bytes || !full || fb->format->format == DRM_FORMAT_XRGB8888) {
-		tr = ili9325->tx_buf;
-		ret = ili9325_rgb565_buf_copy(tr, fb, rect, ili9325->swap_bytes);
-		if (ret)
-			goto err_exit;
+/* Drop @count pending messages and send the events when the buffer is done */
+static void ili9325_txbuf_put(struct ili9325_txbuf *txbuf, unsigned int count)
+{
+	struct tinydrm_ili9325 *ili9325 = txbuf->ili9325;
+	ktime_t posted[ILI9325_TXBUF_FRAMES], now = ktime_get();
+	unsigned int i, num_frames = 0;
+	unsigned long flags;
+	u64 bus_ns = 0;
+	LIST_HEAD(events);
+	int pending;
+
+	spin_lock_irqsave(&ili9325->frame_lock, flags);
+	pending = atomic_sub_return(count, &txbuf->pending);
+	if (!pending) {
+		list_splice_init(&txbuf->events, &events);
+		num_frames = txbuf->num_frames;
+		memcpy(posted, txbuf->frame_posted, num_frames * sizeof(ktime_t));
+		txbuf->num_frames = 0;
+		complete_all(&txbuf->done);
+
+		if (!--ili9325->bus_busy)
+			bus_ns = ktime_to_ns(ktime_sub(now, ili9325->bus_start));
+		tinydrm_stats_bus(&ili9325->mbox.stats, bus_ns,
+				  txbuf->status ? 0 : txbuf->prep_len);
+	}
+	spin_unlock_irqrestore(&ili9325->frame_lock, flags);
+
+	trace_tinydrm_spi_complete(&ili9325->drm, txbuf - ili9325->txbufs, pending);
+
+	for (i = 0; i < num_frames; i++)
+		tinydrm_stats_frame(&ili9325->mbox.stats, posted[i]);
+
+	ili9325_send_events(ili9325, &events);
+}
+
+static void ili9325_txbuf_complete(void *context)
+{
+	ili9325_txbuf_put(context, 1);
+}
+
+/* Wait for the buffer to go out on the bus and return its status */
+static int ili9325_txbuf_wait(struct ili9325_txbuf *txbuf)
+{
+	int ret = txbuf->status;
+	unsigned int i;
+
+	wait_for_completion(&txbuf->done);
+
+	for (i = 0; i < txbuf->num_submitted && !ret; i++)
+		ret = ili9325_txbuf_msg(txbuf, i)->status;
+
+	txbuf->num_submitted = 0;
+	txbuf->status = 0;
+
+	return ret;
+}
+
+/*
+ * The largest pixel transfer. It has to fit in a message together with the
+ * start byte and 16-bit transfers need an even length.
+ */
+static size_t ili9325_max_chunk(struct spi_device *spi)
+{
+	size_t max_chunk = min(spi_max_transfer_size(spi),
+			       spi_max_message_size(spi) - 1);
+
+	return round_down(max_chunk, 2);
+}
+
+/*
+ * Prepared window setup only matches as long as the cache state it was built
+ * against does, another buffer might have moved the window in between.
+ */
+static bool ili9325_txbuf_is_prepared(struct ili9325_txbuf *txbuf,
+				      struct drm_rect *rect, const void *buf,
+				      size_t len, u32 speed_hz)
+{
+	if (!txbuf->prepared || txbuf->prep_buf != buf ||
+	    txbuf->prep_len != len || txbuf->prep_speed_hz != speed_hz ||
+	    txbuf->prep_window != !!rect)
+		return false;
+
+	return !rect || (drm_rect_equals(&txbuf->prep_rect, rect) &&
+			 txbuf->prep_window_cached == ili9325_window_cached(txbuf->ili9325, rect));
+}
+
+/*
+ * The pixels go out in as few messages as the controller allows, normally
+ * just one. The chunks are chained as transfers in the message so the start
+ * byte is sent once and CS stays asserted throughout.
+ */
+static void ili9325_txbuf_prepare(struct tinydrm_ili9325 *ili9325,
+				  struct ili9325_txbuf *txbuf,
+				  struct drm_rect *rect, const void *buf,
+				  size_t len, u32 speed_hz)
+{
+	struct spi_device *spi = ili9325->spi;
+	u32 norm_speed_hz = ili9325_safe_speed(ili9325);
+	u8 *startbyte = &txbuf->cmd_buf[ILI9325_CMD_BUF_SIZE];
+	size_t max_msg = spi_max_message_size(spi);
+	size_t max_chunk = ili9325_max_chunk(spi);
+	struct spi_transfer *tr = txbuf->trs;
+	struct spi_message *m = NULL;
+	unsigned int num_msgs = 0;
+	size_t msg_len = 0;
+	u8 bpw = 16;
+
+	txbuf->prepared = true;
+	txbuf->prep_window = rect;
+	if (rect) {
+		txbuf->prep_rect = *rect;
+		txbuf->prep_window_cached = ili9325_window_cached(ili9325, rect);
+	}
+	txbuf->prep_buf = buf;
+	txbuf->prep_len = len;
+	txbuf->prep_speed_hz = speed_hz;
+
+	/* Bytes have already been swapped if necessary */
+	if (!spi_is_bpw_supported(spi, 16))
+		bpw = 8;
+
+	/* Without a window the pixels continue where the previous buffer ended */
+	ili9325_batch_init(ili9325, &txbuf->batch, txbuf->cmd_buf);
+	if (rect)
+		ili9325_batch_window(ili9325, &txbuf->batch, rect, txbuf->prep_window_cached);
+
+	*startbyte = ili9325_get_startbyte(0, 1, 0);
+
+	while (len) {
+		size_t chunk = min(len, max_chunk);
+
+		if (!m || msg_len + chunk > max_msg) {
+			m = &txbuf->msgs[num_msgs++];
+			spi_message_init(m);
+			*tr = (struct spi_transfer) {
+				.tx_buf = startbyte,
+				.len = 1,
+				.bits_per_word = 8,
+				.speed_hz = norm_speed_hz,
+			};
+			spi_message_add_tail(tr++, m);
+			msg_len = 1;
+		}
+
+		*tr = (struct spi_transfer) {
+			.tx_buf = buf,
+			.len = chunk,
+			.bits_per_word = bpw,
+			.speed_hz = speed_hz,
+		};
+		spi_message_add_tail(tr++, m);
+		msg_len += chunk;
+
+		buf += chunk;
+		len -= chunk;
+	}
+
+	txbuf->prep_num_msgs = num_msgs + !!txbuf->batch.num;
+}
+
+static int ili9325_txbuf_submit(struct tinydrm_ili9325 *ili9325,
+				struct ili9325_txbuf *txbuf,
+				struct drm_rect *rect, const void *buf, size_t len)
+{
+	struct spi_device *spi = ili9325->spi;
+	u32 speed_hz = ili9325->pixel_speed_hz;
+	unsigned int i, num;
+	int ret = 0;
+
+	if (WARN_ON_ONCE(DIV_ROUND_UP(len, ili9325_max_chunk(spi)) > txbuf->max_chunks))
+		return -EINVAL;
+
+	if (len <= 64)
+		speed_hz = ili9325_safe_speed(ili9325);
+
+	if (ili9325_txbuf_is_prepared(txbuf, rect, buf, len, speed_hz)) {
+		ili9325->prepared_hits++;
 	} else {
-		tr = cma_obj->vaddr;
-	}
-
-	switch (ili9325->set_win_type) {
-	case 0:
-		ili9325_write(ili9325, 0x50, rect->x1);
-		ili9325_write(ili9325, 0x51, rect->x2 - 1);
-		ili9325_write(ili9325, 0x52, rect->y1);
-		ili9325_write(ili9325, 0x53, rect->y2 - 1);
-		ili9325_write(ili9325, 0x20, rect->x1);
-		ili9325_write(ili9325, 0x21, rect->y1);
-		break;
-	case 1:
-		ili9325_write(ili9325, 0x50, rect->y1);
-		ili9325_write(ili9325, 0x51, rect->y2 - 1);
-		ili9325_write(ili9325, 0x52, 319 - (rect->x2 - 1));
-		ili9325_write(ili9325, 0x53, 319 - rect->x1);
-		ili9325_write(ili9325, 0x20, rect->y1);
-		ili9325_write(ili9325, 0x21, 319 - rect->x1);
-		break;
-	case 2:
-		ili9325_write(ili9325, 0x50, 239 - (rect->x2 - 1));
-		ili9325_write(ili9325, 0x51, 239 - rect->x1);
-		ili9325_write(ili9325, 0x52, 319 - (rect->y2 - 1));
-		ili9325_write(ili9325, 0x53, 319 - rect->y1);
-		ili9325_write(ili9325, 0x20, 239 - rect->x1);
-		ili9325_write(ili9325, 0x21, 319 - rect->y1);
-		break;
-	case 3:
-		ili9325_write(ili9325, 0x50, 239 - (rect->y2 - 1));
-		ili9325_write(ili9325, 0x51, 239 - rect->y1);
-		ili9325_write(ili9325, 0x52, rect->x1);
-		ili9325_write(ili9325, 0x53, rect->x2 - 1);
-		ili9325_write(ili9325, 0x20, 239 - rect->y1);
-		ili9325_write(ili9325, 0x21, rect->x1);
-		break;
-	};
+		ili9325_txbuf_prepare(ili9325, txbuf, rect, buf, len, speed_hz);
+		ili9325->prepared_misses++;
+	}
 
-	ret = ili9325_writebuf(ili9325, 0x0022, tr, width * height * 2);
+	num = txbuf->prep_num_msgs;
+	ili9325->last_txbuf = txbuf;
+	txbuf->num_submitted = 0;
+	txbuf->status = 0;
+	atomic_set(&txbuf->pending, num);
+	reinit_completion(&txbuf->done);
 
-err_exit:
+	/* Bus time is counted while any buffer is in flight */
+	spin_lock_irq(&ili9325->frame_lock);
+	if (!ili9325->bus_busy++)
+		ili9325->bus_start = ktime_get();
+	spin_unlock_irq(&ili9325->frame_lock);
+
+	for (i = 0; i < num; i++) {
+		struct spi_message *m = ili9325_txbuf_msg(txbuf, i);
+
+		m->complete = ili9325_txbuf_complete;
+		m->context = txbuf;
+		m->actual_length = 0;
+
+		ret = spi_async(spi, m);
+		if (ret) {
+			txbuf->status = ret;
+			/* Start over in case the core left the messages half set up */
+			txbuf->prepared = false;
+			ili9325_txbuf_put(txbuf, num - i);
+			break;
+		}
+
+		trace_tinydrm_spi_submit(&ili9325->drm, txbuf - ili9325->txbufs, i,
+					 m->frame_length);
+		ili9325->num_msgs++;
+		txbuf->num_submitted++;
+	}
+
+	if (rect) {
+		if (ret)
+			ili9325_window_invalidate(ili9325);
+		else
+			ili9325_window_commit(ili9325, rect);
+	}
+
+	return ret;
+}
+
+/* Get the next buffer in the ring when it's done with its previous transfer */
+static struct ili9325_txbuf *ili9325_txbuf_get(struct tinydrm_ili9325 *ili9325)
+{
+	struct ili9325_txbuf *txbuf = &ili9325->txbufs[ili9325->next_txbuf];
+	int ret;
+
+	ili9325->next_txbuf = (ili9325->next_txbuf + 1) % ili9325->num_txbufs;
+
+	ret = ili9325_txbuf_wait(txbuf);
+	if (ret) {
+		ili9325_window_invalidate(ili9325);
+		dev_err_once(ili9325->drm.dev, "Failed to update display %d\n", ret);
+	}
+
+	return txbuf;
+}
+
+/* Wait for all buffers in flight */
+static void __ili9325_flush_wait(struct tinydrm_ili9325 *ili9325)
+{
+	unsigned int i;
+	int ret;
+
+	lockdep_assert_held(&ili9325->cmd_lock);
+
+	for (i = 0; i < ili9325->num_txbufs; i++) {
+		ret = ili9325_txbuf_wait(&ili9325->txbufs[i]);
+		if (ret)
+			dev_err_once(ili9325->drm.dev, "Failed to update display %d\n", ret);
+	}
+}
+
+static void ili9325_flush_wait(struct tinydrm_ili9325 *ili9325)
+{
+	mutex_lock(&ili9325->cmd_lock);
+	__ili9325_flush_wait(ili9325);
+	mutex_unlock(&ili9325->cmd_lock);
+}
+
+static int ili9325_txbufs_init(struct tinydrm_ili9325 *ili9325)
+{
+	struct device *dev = &ili9325->spi->dev;
+	unsigned int i, max_chunks;
+	size_t len;
+
+	if (ili9325->stripe_height) {
+		ili9325->num_txbufs = ILI9325_NUM_STRIPE_BUFS;
+		len = ili9325->stripe_height * 320 * 2;
+	} else {
+		ili9325->num_txbufs = ILI9325_NUM_FRAME_BUFS;
+		len = 320 * 240 * 2;
+	}
+
+	ili9325->txbufs = devm_kcalloc(dev, ili9325->num_txbufs,
+				       sizeof(*ili9325->txbufs), GFP_KERNEL);
+	if (!ili9325->txbufs)
+		return -ENOMEM;
+
+	/*
+	 * The zero-copy path sends a full frame from any buffer. There's at
+	 * most one message per chunk, each with a start byte transfer.
+	 */
+	max_chunks = DIV_ROUND_UP(320 * 240 * 2, ili9325_max_chunk(ili9325->spi));
+
+	for (i = 0; i < ili9325->num_txbufs; i++) {
+		struct ili9325_txbuf *txbuf = &ili9325->txbufs[i];
+
+		txbuf->buf = devm_kmalloc(dev, len, GFP_KERNEL);
+		/* One extra byte for the pixel data start byte */
+		txbuf->cmd_buf = devm_kmalloc(dev, ILI9325_CMD_BUF_SIZE + 1, GFP_KERNEL);
+		txbuf->msgs = devm_kcalloc(dev, max_chunks, sizeof(*txbuf->msgs), GFP_KERNEL);
+		txbuf->trs = devm_kcalloc(dev, max_chunks * 2, sizeof(*txbuf->trs), GFP_KERNEL);
+		if (!txbuf->buf || !txbuf->cmd_buf || !txbuf->msgs || !txbuf->trs)
+			return -ENOMEM;
+
+		txbuf->ili9325 = ili9325;
+		txbuf->max_chunks = max_chunks;
+		INIT_LIST_HEAD(&txbuf->events);
+		init_completion(&txbuf->done);
+		complete_all(&txbuf->done);
+	}
+
+	return 0;
+}
+
+/*
+ * SPI pixel clock calibration
+ *
+ * Cable length and panel batch decide how fast pixel data can be clocked
+ * out. On boards with MISO wired up the highest reliable clock is found by
+ * writing test patterns to a few GRAM lines at the candidate clock and
+ * reading them back through register 0x22 at a safe clock. The lines are
+ * restored afterwards.
+ */
+
+#define ILI9325_CAL_LINES	4
+/* GRAM reads start with dummy bytes, the number is detected */
+#define ILI9325_CAL_MAX_DUMMY	6
+#define ILI9325_CAL_MAX_HZ	64000000
+#define ILI9325_CAL_STEP_HZ	500000
+#define ILI9325_CAL_PATTERNS	3
+#define ILI9325_CAL_CONFIRM	8
+
+struct ili9325_cal {
+	struct drm_rect rect;
+	size_t len;
+	unsigned int dummy;
+	u8 *saved;
+	u8 *pattern;
+	u8 *rx;
+	u32 effective_hz;
+};
+
+/* Write big endian pixels to a GRAM window */
+static int ili9325_gram_write(struct tinydrm_ili9325 *ili9325, struct ili9325_cal *cal,
+			      const u8 *buf, u32 speed_hz)
+{
+	struct spi_transfer tr[2] = {
+		{
+			.tx_buf = ili9325->cmd_buf,
+			.len = 1,
+			.bits_per_word = 8,
+			.speed_hz = ili9325_safe_speed(ili9325),
+		}, {
+			.tx_buf = buf,
+			.len = cal->len,
+			.bits_per_word = 8,
+			.speed_hz = speed_hz,
+		},
+	};
+	struct spi_message m;
+	int ret;
+
+	ret = ili9325_window_sync(ili9325, &cal->rect);
+	if (ret)
+		return ret;
+
+	*ili9325->cmd_buf = ili9325_get_startbyte(0, 1, 0);
+	spi_message_init_with_transfers(&m, tr, ARRAY_SIZE(tr));
+	ret = ili9325_spi_sync(ili9325, &m);
+	if (!ret && tr[1].effective_speed_hz)
+		cal->effective_hz = tr[1].effective_speed_hz;
+
+	return ret;
+}
+
+/* Read back a GRAM window including the dummy bytes */
+static int ili9325_gram_read(struct tinydrm_ili9325 *ili9325, struct ili9325_cal *cal)
+{
+	u32 speed_hz = ili9325_read_speed(ili9325);
+	struct spi_transfer tr[2] = {
+		{
+			.tx_buf = ili9325->cmd_buf,
+			.len = 1,
+			.bits_per_word = 8,
+			.speed_hz = speed_hz,
+		}, {
+			.rx_buf = cal->rx,
+			.len = cal->len + ILI9325_CAL_MAX_DUMMY,
+			.bits_per_word = 8,
+			.speed_hz = speed_hz,
+		},
+	};
+	struct spi_message m;
+	int ret;
+
+	ret = ili9325_window_sync(ili9325, &cal->rect);
+	if (ret)
+		return ret;
+
+	*ili9325->cmd_buf = ili9325_get_startbyte(0, 1, true);
+	spi_message_init_with_transfers(&m, tr, ARRAY_SIZE(tr));
+
+	return ili9325_spi_sync(ili9325, &m);
+}
+
+static void ili9325_cal_fill(struct ili9325_cal *cal, unsigned int pattern)
+{
+	u32 seed = 0x12345678 + pattern;
+	size_t i;
+
+	for (i = 0; i < cal->len; i++) {
+		switch (pattern) {
+		case 0:
+			/* Toggle every data line on every clock */
+			cal->pattern[i] = i & 1 ? 0xaa : 0x55;
+			break;
+		case 1:
+			cal->pattern[i] = i & 2 ? 0xff : 0x00;
+			break;
+		default:
+			seed = seed * 1664525 + 1013904223;
+			cal->pattern[i] = seed >> 24;
+			break;
+		}
+	}
+}
+
+static int ili9325_cal_test(struct tinydrm_ili9325 *ili9325, struct ili9325_cal *cal,
+			    u32 speed_hz)
+{
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < ILI9325_CAL_PATTERNS; i++) {
+		ili9325_cal_fill(cal, i);
+		ret = ili9325_gram_write(ili9325, cal, cal->pattern, speed_hz);
+		if (!ret)
+			ret = ili9325_gram_read(ili9325, cal);
+		if (ret)
+			return ret;
+
+		if (memcmp(cal->rx + cal->dummy, cal->pattern, cal->len))
+			return -EIO;
+	}
+
+	return 0;
+}
+
+/* Find out how many dummy bytes precede the GRAM data at a safe clock */
+static int ili9325_cal_dummy(struct tinydrm_ili9325 *ili9325, struct ili9325_cal *cal)
+{
+	int ret;
+
+	ili9325_cal_fill(cal, ILI9325_CAL_PATTERNS - 1);
+	ret = ili9325_gram_write(ili9325, cal, cal->pattern, ili9325_safe_speed(ili9325));
+	if (!ret)
+		ret = ili9325_gram_read(ili9325, cal);
+	if (ret)
+		return ret;
+
+	for (cal->dummy = 0; cal->dummy <= ILI9325_CAL_MAX_DUMMY; cal->dummy++)
+		if (!memcmp(cal->rx + cal->dummy, cal->pattern, cal->len))
+			return 0;
+
+	return -EIO;
+}
+
+static int ili9325_cal_search(struct tinydrm_ili9325 *ili9325, struct ili9325_cal *cal)
+{
+	struct spi_controller *ctlr = ili9325->spi->controller;
+	u32 lo = ili9325_safe_speed(ili9325);
+	u32 hi = ILI9325_CAL_MAX_HZ;
+	unsigned int passes = 0;
+
+	if (ctlr->max_speed_hz)
+		hi = min(hi, ctlr->max_speed_hz);
+
+	if (ili9325_cal_test(ili9325, cal, lo)) {
+		dev_err(ili9325->drm.dev, "GRAM test failed at %u Hz\n", lo);
+		return -EIO;
+	}
+
+	if (!ili9325_cal_test(ili9325, cal, hi))
+		lo = hi;
+
+	while (hi - lo > ILI9325_CAL_STEP_HZ) {
+		u32 mid = lo + (hi - lo) / 2;
+
+		if (ili9325_cal_test(ili9325, cal, mid))
+			hi = mid;
+		else
+			lo = mid;
+	}
+
+	/* Step down until the clock holds up over repeated runs */
+	while (passes < ILI9325_CAL_CONFIRM) {
+		if (!ili9325_cal_test(ili9325, cal, lo)) {
+			passes++;
+			continue;
+		}
+
+		passes = 0;
+		lo -= ILI9325_CAL_STEP_HZ;
+		if (lo <= ili9325_safe_speed(ili9325))
+			return ili9325_safe_speed(ili9325);
+	}
+
+	return lo;
+}
+
+/*
+ * Returns the highest reliable pixel clock in Hz and starts using it, or a
+ * negative error code.
+ */
+static int ili9325_calibrate(struct tinydrm_ili9325 *ili9325)
+{
+	size_t max_len = spi_max_transfer_size(ili9325->spi) - ILI9325_CAL_MAX_DUMMY;
+	struct ili9325_cal cal = {};
+	unsigned int vscroll, width;
+	int ret, err;
+
+	if (!ili9325->devcode || !ili9325->enabled)
+		return -ENODEV;
+
+	/* Framebuffer width as placed by the entry mode, the plane can be rotated */
+	width = ili9325->entry_mode & ILI9325_ENTRY_AM ? 320 : 240;
+	cal.rect.x2 = width;
+	cal.rect.y2 = ILI9325_CAL_LINES;
+	cal.len = min_t(size_t, width * ILI9325_CAL_LINES * 2,
+			round_down(max_len, 2));
+	cal.rect.y2 = DIV_ROUND_UP(cal.len / 2, width);
+
+	cal.saved = kmalloc(cal.len + ILI9325_CAL_MAX_DUMMY, GFP_KERNEL);
+	cal.pattern = kmalloc(cal.len, GFP_KERNEL);
+	cal.rx = kmalloc(cal.len + ILI9325_CAL_MAX_DUMMY, GFP_KERNEL);
+	if (!cal.saved || !cal.pattern || !cal.rx) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	mutex_lock(&ili9325->cmd_lock);
+
+	__ili9325_flush_wait(ili9325);
+
+	/* Use GRAM lines directly so the window can't wrap around the ring */
+	vscroll = ili9325->vscroll;
+	ili9325->vscroll = 0;
+
+	swap(cal.saved, cal.rx);
+	ret = ili9325_gram_read(ili9325, &cal);
+	swap(cal.saved, cal.rx);
+	if (ret)
+		goto out_unlock;
+
+	ret = ili9325_cal_dummy(ili9325, &cal);
+	if (ret) {
+		/* Can't restore without knowing where the data starts */
+		dev_err(ili9325->drm.dev, "GRAM readback failed, is MISO wired up?\n");
+		goto out_unlock;
+	}
+
+	ret = ili9325_cal_search(ili9325, &cal);
+	if (ret > 0)
+		ili9325->pixel_speed_hz = ret;
+
+	err = ili9325_gram_write(ili9325, &cal, cal.saved + cal.dummy,
+				 ili9325_safe_speed(ili9325));
+	if (err && ret > 0)
+		ret = err;
+
+out_unlock:
+	ili9325->vscroll = vscroll;
+	mutex_unlock(&ili9325->cmd_lock);
+
+	if (ret > 0)
+		dev_info(ili9325->drm.dev, "Pixel clock calibrated to %u Hz (effective %u Hz)\n",
+			 ret, cal.effective_hz);
+out_free:
+	kfree(cal.saved);
+	kfree(cal.pattern);
+	kfree(cal.rx);
+
+	return ret;
+}
+
+/*
+ * Unlike the drm_fb_*() helpers this doesn't allocate a line buffer on every
+ * call, it uses the one preallocated at probe time.
+ */
+static int __ili9325_rgb565_buf_copy(struct tinydrm_ili9325 *ili9325, void *dst,
+				     struct drm_framebuffer *fb, struct drm_rect *clip)
+{
+	struct drm_gem_cma_object *cma_obj = drm_fb_cma_get_gem_obj(fb, 0);
+	struct dma_buf_attachment *import_attach = cma_obj->base.import_attach;
+	unsigned int width = drm_rect_width(clip);
+	unsigned int cpp = fb->format->cpp[0];
+	u32 format = fb->format->format;
+	bool swap = ili9325->swap_bytes;
+	void *src = cma_obj->vaddr;
+	ktime_t start = ktime_get();
+	unsigned int y;
+	int ret = 0;
+	u64 ns;
+
+	if (fb->format->is_yuv) {
+		ret = tinydrm_yuv_buf_copy(dst, fb, clip, ili9325->mbox.flush_yuv,
+					   swap, ili9325->line_buf);
+		goto out_account;
+	}
+
+	if (cpp == 2)
+		swap = tinydrm_rgb565_swap(format, swap);
+
+	if (import_attach) {
+		ret = dma_buf_begin_cpu_access(import_attach->dmabuf,
+					       DMA_FROM_DEVICE);
+		if (ret)
+			return ret;
+	}
+
+	if (cpp == 2 && !swap) {
+		drm_fb_memcpy(dst, src, fb, clip);
+		goto out_end_access;
+	}
+
+	src += clip->y1 * fb->pitches[0] + clip->x1 * cpp;
+
+	for (y = clip->y1; y < clip->y2; y++) {
+		/*
+		 * The cma memory is write-combined so reads are uncached.
+		 * Speed up by fetching one line at a time.
+		 */
+		memcpy(ili9325->line_buf, src, width * cpp);
+
+		switch (format) {
+		case DRM_FORMAT_RGB565:
+		case DRM_FORMAT_RGB565 | DRM_FORMAT_BIG_ENDIAN:
+			tinydrm_swab16_line(dst, ili9325->line_buf, width);
+			break;
+		case DRM_FORMAT_C8:
+			tinydrm_c8_to_rgb565_line(dst, ili9325->line_buf, width,
+						  ili9325->mbox.flush_palette, swap);
+			break;
+		case DRM_FORMAT_XRGB8888:
+			tinydrm_xrgb8888_to_rgb565_line(dst, ili9325->line_buf,
+							width, swap);
+			break;
+		default:
+			ret = -EINVAL;
+			goto out_end_access;
+		}
+
+		src += fb->pitches[0];
+		dst += width * sizeof(u16);
+	}
+
+out_end_access:
+	if (import_attach) {
+		int err;
+
+		err = dma_buf_end_cpu_access(import_attach->dmabuf,
+					     DMA_FROM_DEVICE);
+		if (!ret)
+			ret = err;
+	}
+
+out_account:
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	trace_tinydrm_convert(&ili9325->drm, fb->format->format, width,
+			      drm_rect_height(clip), ns);
+	ili9325->convert_ns += ns;
+	ili9325->convert_bytes += width * drm_rect_height(clip) * 2;
+	tinydrm_stats_convert(&ili9325->mbox.stats, ns);
+
+	return ret;
+}
+
+/* @clip is on the display, an upscaled framebuffer is replicated in place */
+static int ili9325_rgb565_buf_copy(struct tinydrm_ili9325 *ili9325, void *dst,
+				   struct drm_framebuffer *fb, struct drm_rect *clip)
+{
+	unsigned int scale_x = ili9325->mbox.flush_scale_x;
+	unsigned int scale_y = ili9325->mbox.flush_scale_y;
+	struct drm_rect src;
+	int ret;
+
+	tinydrm_mailbox_fb_clip(&ili9325->mbox, &src, clip);
+	ret = __ili9325_rgb565_buf_copy(ili9325, dst, fb, &src);
+	if (!ret && (scale_x || scale_y))
+		tinydrm_upscale(dst, clip, scale_x, scale_y);
+
+	return ret;
+}
+
+/* Size of the framebuffer on the display, never more than the panel */
+static unsigned int ili9325_frame_width(struct tinydrm_ili9325 *ili9325)
+{
+	return drm_rect_width(&ili9325->mbox.flush_display);
+}
+
+static unsigned int ili9325_frame_height(struct tinydrm_ili9325 *ili9325)
+{
+	return drm_rect_height(&ili9325->mbox.flush_display);
+}
+
+/*
+ * Compare the damaged area against the shadow copy of what was last sent to
+ * GRAM and return the bands of lines that changed. Changed lines are grouped
+ * into the same band unless the unchanged lines in between cost more to send
+ * than setting up a new window. The shadow buffer is updated as we go.
+ * @frame is the already converted framebuffer or NULL to convert line by line.
+ */
+static int ili9325_shadow_diff(struct tinydrm_ili9325 *ili9325,
+			       struct drm_framebuffer *fb, struct drm_rect *rect,
+			       const u16 *frame, struct drm_rect *bands,
+			       unsigned int max_bands)
+{
+	unsigned int pitch = ili9325_frame_width(ili9325);
+	unsigned int width = drm_rect_width(rect);
+	struct drm_rect *band = NULL;
+	unsigned int num = 0;
+	unsigned int y;
+	int ret;
+
+	for (y = rect->y1; y < rect->y2; y++) {
+		struct drm_rect clip = {
+			.x1 = rect->x1,
+			.x2 = rect->x2,
+			.y1 = y,
+			.y2 = y + 1,
+		};
+		u16 *shadow = ili9325->shadow + (y * pitch + rect->x1) * 2;
+		const u16 *line = ili9325->diff_buf;
+		unsigned int x1 = 0, x2 = width;
+
+		if (frame) {
+			line = frame + y * pitch + rect->x1;
+		} else {
+			ret = ili9325_rgb565_buf_copy(ili9325, ili9325->diff_buf, fb, &clip);
+			if (ret)
+				return ret;
+		}
+
+		if (ili9325->shadow_valid) {
+			if (!memcmp(shadow, line, width * 2))
+				continue;
+
+			while (shadow[x1] == line[x1])
+				x1++;
+			while (shadow[x2 - 1] == line[x2 - 1])
+				x2--;
+		}
+
+		memcpy(&shadow[x1], &line[x1], (x2 - x1) * 2);
+
+		clip.x1 = rect->x1 + x1;
+		clip.x2 = rect->x1 + x2;
+
+		if (band && (num == max_bands ||
+			     (y - band->y2) * drm_rect_width(band) * 2 <= ili9325->damage.setup_cost)) {
+			band->x1 = min(band->x1, clip.x1);
+			band->x2 = max(band->x2, clip.x2);
+			band->y2 = clip.y2;
+		} else {
+			band = &bands[num++];
+			*band = clip;
+		}
+	}
+
+	return num;
+}
+
+#define ILI9325_SCROLL_CANDIDATES	4
+
+/*
+ * Console and terminal scrolling moves most lines up or down by the same
+ * amount. Returns the number of lines the content moved up (negative for
+ * down) or zero if shifting the shadow buffer doesn't match more lines.
+ */
+static int ili9325_scroll_detect(struct tinydrm_ili9325 *ili9325,
+				 const u8 *frame, unsigned int height,
+				 size_t pitch)
+{
+	int candidates[ILI9325_SCROLL_CANDIDATES];
+	const u8 *shadow = ili9325->shadow;
+	unsigned int i, y, y0, d, same = 0;
+	unsigned int num = 0, best_score;
+	int best = 0;
+
+	for (y = 0; y < height; y++)
+		same += !memcmp(frame + y * pitch, shadow + y * pitch, pitch);
+	if (same == height)
+		return 0;
+
+	for (y0 = 0; y0 < height; y0++)
+		if (memcmp(frame + y0 * pitch, shadow + y0 * pitch, pitch))
+			break;
+
+	/* Where did the first changed line come from, nearest first */
+	for (d = 1; d < height && num < ARRAY_SIZE(candidates); d++) {
+		if (y0 + d < height &&
+		    !memcmp(frame + y0 * pitch, shadow + (y0 + d) * pitch, pitch))
+			candidates[num++] = d;
+		if (d <= y0 && num < ARRAY_SIZE(candidates) &&
+		    !memcmp(frame + y0 * pitch, shadow + (y0 - d) * pitch, pitch))
+			candidates[num++] = -d;
+	}
+
+	best_score = same;
+	for (i = 0; i < num; i++) {
+		int k = candidates[i];
+		unsigned int y1 = k < 0 ? -k : 0;
+		unsigned int y2 = k > 0 ? height - k : height;
+		unsigned int score = 0;
+
+		for (y = y1; y < y2; y++)
+			score += !memcmp(frame + y * pitch, shadow + (y + k) * pitch, pitch);
+
+		if (score > best_score) {
+			best_score = score;
+			best = k;
+		}
+	}
+
+	return best;
+}
+
+static void ili9325_shadow_reverse(struct tinydrm_ili9325 *ili9325, size_t pitch,
+				   unsigned int y1, unsigned int y2)
+{
+	void *tmp = ili9325->diff_buf;
+
+	while (y2 - y1 > 1) {
+		void *a = ili9325->shadow + y1++ * pitch;
+		void *b = ili9325->shadow + --y2 * pitch;
+
+		memcpy(tmp, a, pitch);
+		memcpy(a, b, pitch);
+		memcpy(b, tmp, pitch);
+	}
+}
+
+/*
+ * Scroll the display by @k lines, positive moves the content up. Only the
+ * scroll offset register is written, the shadow buffer is rotated to match
+ * what is now shown so the diff picks up the exposed lines. The offset moves
+ * every window, so the prepared messages have to be rebuilt. Caller holds
+ * cmd_lock.
+ */
+static int ili9325_scroll(struct tinydrm_ili9325 *ili9325, int k,
+			  unsigned int height, size_t pitch)
+{
+	unsigned int shift = (k + height) % height;
+	unsigned int vscroll, i;
+	int ret;
+
+	/* Fb lines run towards lower GRAM lines when the vertical address decrements */
+	if (!(ili9325->entry_mode & ILI9325_ENTRY_ID1))
+		vscroll = (ili9325->vscroll + 320 - shift) % 320;
+	else
+		vscroll = (ili9325->vscroll + shift) % 320;
+
+	__ili9325_flush_wait(ili9325);
+	for (i = 0; i < ili9325->num_txbufs; i++)
+		ili9325->txbufs[i].prepared = false;
+
+	ret = regmap_write(ili9325->regmap, 0x006a, vscroll);
+	if (ret)
+		return ret;
+
+	ili9325->vscroll = vscroll;
+
+	/* Rotate by three reversals, line i now holds what was at i + k */
+	ili9325_shadow_reverse(ili9325, pitch, 0, shift);
+	ili9325_shadow_reverse(ili9325, pitch, shift, height);
+	ili9325_shadow_reverse(ili9325, pitch, 0, height);
+
+	ili9325->scrolls++;
+	ili9325->scroll_lines += abs(k);
+
+	return 0;
+}
+
+/*
+ * Scrolling is possible when the fb lines map to the GRAM lines that the
+ * scroll offset applies to, which is the portrait orientations.
+ */
+static bool ili9325_scroll_possible(struct tinydrm_ili9325 *ili9325,
+				    struct drm_framebuffer *fb, struct drm_rect *rect)
+{
+	unsigned int height = ili9325_frame_height(ili9325);
+
+	return ili9325->vscroll_enabled && ili9325->vscroll_ok &&
+	       ili9325->shadow_valid && height == 320 &&
+	       !(ili9325->entry_mode & ILI9325_ENTRY_AM) &&
+	       drm_rect_width(rect) == ili9325_frame_width(ili9325) &&
+	       drm_rect_height(rect) > height / 2;
+}
+
+/* The fb line where the window has to be split because GRAM lines wrap */
+static unsigned int ili9325_scroll_wrap(struct tinydrm_ili9325 *ili9325)
+{
+	if (!ili9325->vscroll)
+		return 0;
+
+	if (ili9325->entry_mode & ILI9325_ENTRY_ID1)
+		return 320 - ili9325->vscroll;
+
+	return ili9325->vscroll;
+}
+
+/* The shadow copy of GRAM is already converted, so just copy the lines */
+static void ili9325_shadow_copy(struct tinydrm_ili9325 *ili9325, void *dst,
+				struct drm_framebuffer *fb, struct drm_rect *clip)
+{
+	unsigned int pitch = ili9325_frame_width(ili9325);
+	size_t len = drm_rect_width(clip) * 2;
+	unsigned int y;
+
+	for (y = clip->y1; y < clip->y2; y++) {
+		memcpy(dst, ili9325->shadow + (y * pitch + clip->x1) * 2, len);
+		dst += len;
+	}
+}
+
+/*
+ * Flush a rectangle from the framebuffer or from the shadow buffer. @start is
+ * the time the flush started and is cleared when the first pixels are queued.
+ */
+static int ili9325_flush_rect(struct tinydrm_ili9325 *ili9325,
+			      struct drm_framebuffer *fb, struct drm_rect *rect,
+			      bool from_shadow, ktime_t *start)
+{
+	struct drm_gem_cma_object *cma_obj = drm_fb_cma_get_gem_obj(fb, 0);
+	unsigned int height = drm_rect_height(rect);
+	unsigned int width = drm_rect_width(rect);
+	unsigned int stripe_height, y;
+	struct ili9325_txbuf *txbuf;
+	struct drm_rect src;
+	bool contiguous;
+	int ret;
+
+	/* Full width lines follow each other in the framebuffer */
+	tinydrm_mailbox_fb_clip(&ili9325->mbox, &src, rect);
+	contiguous = width == fb->width && fb->pitches[0] == width * 2 &&
+		     !ili9325->mbox.flush_scale_x && !ili9325->mbox.flush_scale_y;
+
+	if (!from_shadow && contiguous && fb->format->cpp[0] == 2 &&
+	    !fb->format->is_yuv &&
+	    !tinydrm_rgb565_swap(fb->format->format, ili9325->swap_bytes)) {
+		txbuf = ili9325_txbuf_get(ili9325);
+		ret = ili9325_txbuf_submit(ili9325, txbuf, rect,
+					   cma_obj->vaddr + src.y1 * fb->pitches[0],
+					   width * height * 2);
+		if (*start) {
+			ili9325->first_byte_us = ktime_us_delta(ktime_get(), *start);
+			*start = 0;
+		}
+
+		/* The framebuffer can go away as soon as we return */
+		if (!ret)
+			ret = ili9325_txbuf_wait(txbuf);
+
+		return ret;
+	}
+
+	stripe_height = ili9325->stripe_height ? : height;
+
+	for (y = rect->y1; y < rect->y2; y += stripe_height) {
+		struct drm_rect clip = {
+			.x1 = rect->x1,
+			.x2 = rect->x2,
+			.y1 = y,
+			.y2 = min(y + stripe_height, (unsigned int)rect->y2),
+		};
+		bool first = y == rect->y1;
+
+		txbuf = ili9325_txbuf_get(ili9325);
+
+		if (from_shadow) {
+			ili9325_shadow_copy(ili9325, txbuf->buf, fb, &clip);
+		} else {
+			ret = ili9325_rgb565_buf_copy(ili9325, txbuf->buf, fb, &clip);
+			if (ret)
+				return ret;
+		}
+
+		ret = ili9325_txbuf_submit(ili9325, txbuf, first ? rect : NULL, txbuf->buf,
+					   width * drm_rect_height(&clip) * 2);
+		if (ret)
+			return ret;
+
+		if (*start) {
+			ili9325->first_byte_us = ktime_us_delta(ktime_get(), *start);
+			*start = 0;
+		}
+	}
+
+	return 0;
+}
+
+static void ili9325_fb_dirty(struct tinydrm_mailbox *mbox,
+			     struct drm_framebuffer *fb, struct drm_rect *rect)
+{
+	struct tinydrm_ili9325 *ili9325 = drm_to_ili9325(fb->dev);
+	struct drm_rect bands[TINYDRM_DAMAGE_MAX_RECTS];
+	struct drm_rect full = {
+		.x2 = ili9325_frame_width(ili9325),
+		.y2 = ili9325_frame_height(ili9325),
+	};
+	ktime_t start = ktime_get();
+	struct drm_rect damaged = *rect;
+	const u16 *frame = NULL;
+	int i, j, num, idx, ret = 0;
+	unsigned int wrap;
+	size_t bytes = 0;
+	u32 msgs;
+
+	if (!ili9325->enabled)
+		return;
+
+	if (!drm_dev_enter(fb->dev, &idx))
+		return;
+
+	DRM_DEBUG_KMS("Flushing [FB:%d] " DRM_RECT_FMT "\n", fb->base.id, DRM_RECT_ARG(rect));
+	trace_tinydrm_flush_start(fb->dev, fb->base.id, rect);
+
+	mutex_lock(&ili9325->cmd_lock);
+
+	msgs = ili9325->num_msgs;
+
+	if (!ili9325->shadow) {
+		ret = ili9325_flush_rect(ili9325, fb, rect, false, &start);
+		if (!ret)
+			bytes = drm_rect_width(rect) * drm_rect_height(rect) * 2;
+		goto out_unlock;
+	}
+
+	if (ili9325_scroll_possible(ili9325, fb, rect)) {
+		size_t pitch = full.x2 * 2;
+		int k;
+
+		ret = ili9325_rgb565_buf_copy(ili9325, ili9325->frame_buf, fb, &full);
+		if (ret)
+			goto out_unlock;
+
+		frame = ili9325->frame_buf;
+		k = ili9325_scroll_detect(ili9325, ili9325->frame_buf, full.y2, pitch);
+		if (k) {
+			DRM_DEBUG_KMS("Scrolling %d lines\n", k);
+			ret = ili9325_scroll(ili9325, k, full.y2, pitch);
+			if (ret)
+				goto out_unlock;
+			/* Every line has moved so diff the whole frame */
+			damaged = full;
+		}
+	}
+
+	num = ili9325_shadow_diff(ili9325, fb, &damaged, frame, bands, ARRAY_SIZE(bands));
+	if (num < 0) {
+		ret = num;
+		goto out_unlock;
+	}
+
+	ili9325->shadow_flushes++;
+	ili9325->shadow_damaged += drm_rect_width(rect) * drm_rect_height(rect);
+	if (!num)
+		ili9325->shadow_identical++;
+
+	wrap = ili9325_scroll_wrap(ili9325);
+	for (i = 0; i < num && !ret; i++) {
+		struct drm_rect parts[2] = { bands[i], bands[i] };
+		unsigned int num_parts = 1;
+
+		if (wrap > bands[i].y1 && wrap < bands[i].y2) {
+			parts[0].y2 = wrap;
+			parts[1].y1 = wrap;
+			num_parts = 2;
+		}
+
+		DRM_DEBUG_KMS("Changed " DRM_RECT_FMT "\n", DRM_RECT_ARG(&bands[i]));
+		ili9325->shadow_flushed += drm_rect_width(&bands[i]) * drm_rect_height(&bands[i]);
+		for (j = 0; j < num_parts; j++) {
+			ret = ili9325_flush_rect(ili9325, fb, &parts[j], true, &start);
+			if (ret)
+				break;
+		}
+		if (!ret)
+			bytes += drm_rect_width(&bands[i]) * drm_rect_height(&bands[i]) * 2;
+	}
+
+	if (!ret && drm_rect_equals(&damaged, &full))
+		ili9325->shadow_valid = true;
+
+out_unlock:
+	/* GRAM no longer matches the shadow buffer */
+	if (ret) {
+		ili9325->shadow_valid = false;
+		ili9325_window_invalidate(ili9325);
+	}
+	ili9325->flush_msgs = ili9325->num_msgs - msgs;
+	mutex_unlock(&ili9325->cmd_lock);
+	/* The pixels may still be on their way, see tinydrm_spi_complete */
+	trace_tinydrm_flush_end(fb->dev, ret, bytes);
 	drm_dev_exit(idx);
 	if (ret)
 		dev_err_once(fb->dev->dev, "Failed to update display %d\n", ret);
 }
 
+/*
+ * Called by the mailbox worker when the rectangles of a frame have been
+ * submitted. The events go out and the frame is accounted when the last
+ * buffer has left the bus. If the buffer has run out of room for post times
+ * the frame is accounted now, which can only happen with a stalled bus.
+ */
+static void ili9325_frame_done(struct tinydrm_mailbox *mbox, struct list_head *events,
+			       ktime_t posted)
+{
+	struct tinydrm_ili9325 *ili9325 = container_of(mbox, struct tinydrm_ili9325, mbox);
+	struct ili9325_txbuf *txbuf;
+	unsigned long flags;
+
+	mutex_lock(&ili9325->cmd_lock);
+	txbuf = ili9325->last_txbuf;
+	if (txbuf) {
+		spin_lock_irqsave(&ili9325->frame_lock, flags);
+		if (atomic_read(&txbuf->pending)) {
+			list_splice_tail_init(events, &txbuf->events);
+			if (posted && txbuf->num_frames < ILI9325_TXBUF_FRAMES) {
+				txbuf->frame_posted[txbuf->num_frames++] = posted;
+				posted = 0;
+			}
+		}
+		spin_unlock_irqrestore(&ili9325->frame_lock, flags);
+	}
+	mutex_unlock(&ili9325->cmd_lock);
+
+	/* Nothing in flight, or no room for the post time */
+	if (posted)
+		tinydrm_stats_frame(&mbox->stats, posted);
+	ili9325_send_events(ili9325, events);
+}
+
+/*
+ * Same as drm_atomic_helper_commit_tail() but signals flip done as soon as
+ * the frame has been posted to the mailbox instead of waiting for vblank.
+ * Vblank only happens when a frame is flushed, so an unchanged framebuffer
+ * would time out waiting for it, and waiting for the bus would serialize
+ * commits on SPI and make nonblocking commits fail with -EBUSY. The mailbox
+ * holds a reference to the framebuffer until it has been flushed and the page
+ * flip event still goes out when the frame has left the bus.
+ */
+static void ili9325_commit_tail(struct drm_atomic_state *old_state)
+{
+	struct drm_device *dev = old_state->dev;
+	struct drm_crtc_state *new_crtc_state;
+	struct drm_crtc *crtc;
+	unsigned int i;
+
+	drm_atomic_helper_commit_modeset_disables(dev, old_state);
+	drm_atomic_helper_commit_planes(dev, old_state, 0);
+	drm_atomic_helper_commit_modeset_enables(dev, old_state);
+	drm_atomic_helper_commit_hw_done(old_state);
+
+	for_each_new_crtc_in_state(old_state, crtc, new_crtc_state, i) {
+		if (new_crtc_state->commit)
+			complete_all(&new_crtc_state->commit->flip_done);
+	}
+
+	drm_atomic_helper_cleanup_planes(dev, old_state);
+}
+
 static void ili9325_reset(struct tinydrm_ili9325 *ili9325)
 {
 	if (!ili9325->reset)
@@ -349,21 +1771,26 @@ static void ili9325_pipe_disable(struct drm_simple_display_pipe *pipe)
 {
 	struct tinydrm_ili9325 *ili9325 = drm_to_ili9325(pipe->crtc.dev);
 
+	tinydrm_mailbox_stop(&ili9325->mbox);
 	ili9325->enabled = false;
+	ili9325_flush_wait(ili9325);
+	drm_crtc_vblank_off(&pipe->crtc);
 	backlight_disable(ili9325->backlight);
 }
 
 static void ili9325_pipe_update(struct drm_simple_display_pipe *pipe,
 				struct drm_plane_state *old_state)
 {
-	struct drm_plane_state *state = pipe->plane.state;
+	struct tinydrm_ili9325 *ili9325 = drm_to_ili9325(pipe->crtc.dev);
 	struct drm_crtc *crtc = &pipe->crtc;
-	struct drm_rect rect;
 
-	if (drm_atomic_helper_damage_merged(old_state, state, &rect))
-		ili9325_fb_dirty(state->fb, &rect);
+	/*
+	 * Flushed by the mailbox worker, only the newest frame is sent. The
+	 * event is taken along and sent when the frame has left the bus.
+	 */
+	tinydrm_mailbox_update(&ili9325->mbox, old_state, pipe->plane.state);
 
-	/* DRM core handles this in Linux 5.7 */
+	/* Display is off, DRM core handles this in Linux 5.7 */
 	if (crtc->state->event) {
 		spin_lock_irq(&crtc->dev->event_lock);
 		drm_crtc_send_vblank_event(crtc, crtc->state->event);
@@ -375,246 +1802,390 @@ static void ili9325_pipe_update(struct drm_simple_display_pipe *pipe,
 static void ili9325_enable_flush(struct tinydrm_ili9325 *ili9325,
 				 struct drm_plane_state *plane_state)
 {
-	struct drm_framebuffer *fb = plane_state->fb;
-	struct drm_rect rect = {
-		.x1 = 0,
-		.x2 = fb->width,
-		.y1 = 0,
-		.y2 = fb->height,
-	};
-
 	ili9325->enabled = true;
-	ili9325_fb_dirty(fb, &rect);
+	drm_crtc_vblank_on(&ili9325->pipe.crtc);
+	if (ili9325->keep_splash)
+		ili9325->keep_splash = false;
+	else
+		tinydrm_mailbox_flush_all(&ili9325->mbox, plane_state);
 	backlight_enable(ili9325->backlight);
 }
 
-/* Uses an ILI9320 controller */
-static void hy28a_pipe_enable(struct drm_simple_display_pipe *pipe,
-			      struct drm_crtc_state *crtc_state,
-			      struct drm_plane_state *plane_state)
+static void ili9325_sleep(unsigned int us)
 {
-	struct tinydrm_ili9325 *ili9325 = drm_to_ili9325(pipe->crtc.dev);
-	struct device *dev = ili9325->drm.dev;
+	if (us < 20 * USEC_PER_MSEC)
+		usleep_range(us, us + us / 4);
+	else
+		msleep(DIV_ROUND_UP(us, USEC_PER_MSEC));
+}
+
+/*
+ * Write a register sequence in batches. An entry with a delay ends the batch
+ * and sleeps without holding the lock.
+ */
+static int ili9325_write_seq(struct tinydrm_ili9325 *ili9325,
+			     const struct reg_sequence *seq, unsigned int num)
+{
+	struct ili9325_batch batch;
+	unsigned int i, first = 0;
+	int ret = 0;
+
+	mutex_lock(&ili9325->cmd_lock);
+	ili9325_batch_init(ili9325, &batch, ili9325->cmd_buf);
+
+	for (i = 0; i < num; i++) {
+		ili9325_batch_write(&batch, seq[i].reg, seq[i].def);
+
+		if (i + 1 < num && !seq[i].delay_us &&
+		    batch.num + 2 <= ILI9325_BATCH_MAX)
+			continue;
+
+		ret = ili9325_batch_sync(ili9325, &batch);
+		if (ret)
+			break;
+
+		for (; first <= i; first++)
+			ili9325_cache_write(ili9325, seq[first].reg, seq[first].def);
+
+		if (seq[i].delay_us) {
+			mutex_unlock(&ili9325->cmd_lock);
+			ili9325_sleep(seq[i].delay_us);
+			mutex_lock(&ili9325->cmd_lock);
+		}
+
+		ili9325_batch_init(ili9325, &batch, ili9325->cmd_buf);
+	}
+
+	mutex_unlock(&ili9325->cmd_lock);
+
+	return ret;
+}
+
+/*
+ * Disabling only turns off the backlight so the controller is normally still
+ * set up. If the bus can be read, check that the display is actually on.
+ */
+static bool ili9325_is_initialized(struct tinydrm_ili9325 *ili9325)
+{
+	unsigned int val;
+	int ret;
+
+	if (!ili9325->initialized)
+		return false;
+
+	if (!ili9325->devcode)
+		return true;
+
+	mutex_lock(&ili9325->cmd_lock);
+	regcache_cache_bypass(ili9325->regmap, true);
+	ret = regmap_read(ili9325->regmap, 0x0007, &val);
+	regcache_cache_bypass(ili9325->regmap, false);
+	mutex_unlock(&ili9325->cmd_lock);
+
+	/* D1-0: Display on */
+	return !ret && (val & 0x3) == 0x3;
+}
+
+/* Entry mode for a plane rotation, reflection is applied before rotation */
+static u16 ili9325_entry_mode(struct tinydrm_ili9325 *ili9325, unsigned int rotation)
+{
+	unsigned int i = tinydrm_rotation_index(ili9325->rotation, rotation);
+	u16 entry_mode = ili9325->entry_modes[i];
+	bool am = entry_mode & ILI9325_ENTRY_AM;
+
+	if (rotation & DRM_MODE_REFLECT_X)
+		entry_mode ^= am ? ILI9325_ENTRY_ID1 : ILI9325_ENTRY_ID0;
+	if (rotation & DRM_MODE_REFLECT_Y)
+		entry_mode ^= am ? ILI9325_ENTRY_ID0 : ILI9325_ENTRY_ID1;
+
+	return entry_mode;
+}
+
+/*
+ * Change how the framebuffer maps onto GRAM. What's in GRAM no longer lines
+ * up with the shadow buffer, the window registers or the prepared messages,
+ * and the scroll offset is dropped. Caller holds cmd_lock.
+ */
+static int ili9325_set_entry_mode(struct tinydrm_ili9325 *ili9325, u16 entry_mode)
+{
+	unsigned int i;
+	int ret;
+
+	__ili9325_flush_wait(ili9325);
+	for (i = 0; i < ili9325->num_txbufs; i++)
+		ili9325->txbufs[i].prepared = false;
+
+	ili9325->shadow_valid = false;
+	ili9325_window_invalidate(ili9325);
+
+	ret = regmap_write(ili9325->regmap, 0x0003, entry_mode);
+	if (ret)
+		return ret;
+
+	ili9325->entry_mode = entry_mode;
+
+	if (ili9325->vscroll) {
+		ret = regmap_write(ili9325->regmap, 0x006a, 0);
+		if (ret)
+			return ret;
+		ili9325->vscroll = 0;
+	}
+
+	return 0;
+}
+
+/* Called from the flush worker before the frame is flushed */
+static void ili9325_set_rotation(struct tinydrm_mailbox *mbox, unsigned int rotation)
+{
+	struct tinydrm_ili9325 *ili9325 = container_of(mbox, struct tinydrm_ili9325, mbox);
+	u16 entry_mode = ili9325_entry_mode(ili9325, rotation);
 	int idx, ret;
 
-	if (!drm_dev_enter(pipe->crtc.dev, &idx))
+	if (entry_mode == ili9325->entry_mode || !ili9325->enabled)
 		return;
 
-	ili9325_reset(ili9325);
+	if (!drm_dev_enter(&ili9325->drm, &idx))
+		return;
+
+	DRM_DEBUG_KMS("Entry mode 0x%04x\n", entry_mode);
+	mutex_lock(&ili9325->cmd_lock);
+	ret = ili9325_set_entry_mode(ili9325, entry_mode);
+	mutex_unlock(&ili9325->cmd_lock);
+	if (ret)
+		dev_err_once(ili9325->drm.dev, "Failed to set rotation %d\n", ret);
+
+	drm_dev_exit(idx);
+}
+
+static void ili9325_pipe_enable(struct tinydrm_ili9325 *ili9325,
+				const struct reg_sequence *init, unsigned int num,
+				const u16 *entry_modes,
+				struct drm_plane_state *plane_state)
+{
+	u16 entry_mode;
+	ktime_t start = ktime_get();
+	int idx, ret;
+
+	if (!drm_dev_enter(&ili9325->drm, &idx))
+		return;
 
-	/* Initialization sequence from HY28A example code */
+	ili9325->entry_modes = entry_modes;
+	entry_mode = ili9325_entry_mode(ili9325, plane_state->rotation);
+
+	if (ili9325_is_initialized(ili9325)) {
+		DRM_DEBUG_KMS("Controller is initialized, skipping reset\n");
+		/* The bootloader has set up the rotation from DT */
+		if (!ili9325->entry_mode)
+			ili9325->entry_mode = ili9325_entry_mode(ili9325, DRM_MODE_ROTATE_0);
+		if (entry_mode != ili9325->entry_mode) {
+			mutex_lock(&ili9325->cmd_lock);
+			ret = ili9325_set_entry_mode(ili9325, entry_mode);
+			mutex_unlock(&ili9325->cmd_lock);
+			if (ret) {
+				dev_err(ili9325->drm.dev, "Failed to write register\n");
+				goto out_exit;
+			}
+		}
+		goto out_enable;
+	}
 
-	ret = ili9325_write(ili9325, 0x00, 0x0000);
+	ili9325_reset(ili9325);
+	ili9325->initialized = false;
+	ili9325->keep_splash = false;
+	ili9325->vscroll_ok = false;
+	/* GRAM content is lost on reset */
+	ili9325->shadow_valid = false;
+
+	ret = ili9325_write_seq(ili9325, init, num);
+	if (!ret) {
+		const struct reg_sequence display_on[] = {
+			{ 0x0003, entry_mode },
+			{ 0x0007, 0x0133, 100000 },
+		};
+
+		ret = ili9325_write_seq(ili9325, display_on, ARRAY_SIZE(display_on));
+	}
 	if (ret) {
-		dev_err(dev, "Failed to write register\n");
+		dev_err(ili9325->drm.dev, "Failed to write register\n");
 		goto out_exit;
 	}
 
-	ili9325_write(ili9325, 0x01, 0x0100);	/* Driver Output Control */
-	ili9325_write(ili9325, 0x02, 0x0700);	/* LCD Driver Waveform Control */
-	ili9325_write(ili9325, 0x03, 0x1038);	/* Set the scan mode */
-	ili9325_write(ili9325, 0x04, 0x0000);	/* Scalling Control */
-	ili9325_write(ili9325, 0x08, 0x0202);	/* Display Control 2 */
-	ili9325_write(ili9325, 0x09, 0x0000);	/* Display Control 3 */
-	ili9325_write(ili9325, 0x0a, 0x0000);	/* Frame Cycle Contal */
-	ili9325_write(ili9325, 0x0c, BIT(0));	/* Extern Display Interface Control 1 */
-	ili9325_write(ili9325, 0x0d, 0x0000);	/* Frame Maker Position */
-	ili9325_write(ili9325, 0x0f, 0x0000);	/* Extern Display Interface Control 2 */
-	mdelay(50);
-	ili9325_write(ili9325, 0x07, 0x0101);	/* Display Control */
-	mdelay(50);
-	ili9325_write(ili9325, 0x10, BIT(12) | BIT(7) | BIT(6)); /* Power Control 1 */
-	ili9325_write(ili9325, 0x11, 0x0007);	/* Power Control 2 */
-	ili9325_write(ili9325, 0x12, BIT(8) | BIT(4));	/* Power Control 3 */
-	ili9325_write(ili9325, 0x13, 0x0b00);	/* Power Control 4 */
-	ili9325_write(ili9325, 0x29, 0x0000);	/* Power Control 7 */
-	ili9325_write(ili9325, 0x2b, BIT(14) | BIT(4));
-
-	ili9325_write(ili9325, 0x50, 0);	/* Set X Start */
-	ili9325_write(ili9325, 0x51, 239);	/* Set X End */
-	ili9325_write(ili9325, 0x52, 0);	/* Set Y Start */
-	ili9325_write(ili9325, 0x53, 319);	/* Set Y End */
-	mdelay(50);
-
-	ili9325_write(ili9325, 0x60, 0x2700);	/* Driver Output Control */
-	ili9325_write(ili9325, 0x61, 0x0001);	/* Driver Output Control */
-	ili9325_write(ili9325, 0x6a, 0x0000);	/* Vertical Srcoll Control */
-
-	ili9325_write(ili9325, 0x80, 0x0000);	/* Display Position? Partial Display 1 */
-	ili9325_write(ili9325, 0x81, 0x0000);	/* RAM Address Start? Partial Display 1 */
-	ili9325_write(ili9325, 0x82, 0x0000);	/* RAM Address End-Partial Display 1 */
-	ili9325_write(ili9325, 0x83, 0x0000);	/* Displsy Position? Partial Display 2 */
-	ili9325_write(ili9325, 0x84, 0x0000);	/* RAM Address Start? Partial Display 2 */
-	ili9325_write(ili9325, 0x85, 0x0000);	/* RAM Address End? Partial Display 2 */
-
-	ili9325_write(ili9325, 0x90, 16); /* Frame Cycle Control */
-	ili9325_write(ili9325, 0x92, 0x0000);	/* Panel Interface Control 2 */
-	ili9325_write(ili9325, 0x93, 0x0001);	/* Panel Interface Control 3 */
-	ili9325_write(ili9325, 0x95, 0x0110);	/* Frame Cycle Control */
-	ili9325_write(ili9325, 0x97, 0);
-	ili9325_write(ili9325, 0x98, 0x0000);	/* Frame Cycle Control */
-
-	switch (ili9325->rotation) {
-	case 0:
-		ili9325_write(ili9325, 0x0003, 0x1028);
-		ili9325->set_win_type = 3;
-		break;
-	case 90:
-		ili9325_write(ili9325, 0x0003, 0x1030);
-		ili9325->set_win_type = 0;
-		break;
-	case 180:
-		ili9325_write(ili9325, 0x0003, 0x1018);
-		ili9325->set_win_type = 1;
-		break;
-	case 270:
-		ili9325_write(ili9325, 0x0003, 0x1000);
-		ili9325->set_win_type = 2;
-		break;
-	}
-
-	ili9325_write(ili9325, 0x0007, 0x0133);
-	mdelay(100);
-
+	ili9325->entry_mode = entry_mode;
+	ili9325->initialized = true;
+	/* The init sequence enables scrolling with a zero offset */
+	ili9325->vscroll = 0;
+	ili9325->vscroll_ok = true;
+out_enable:
 	ili9325_enable_flush(ili9325, plane_state);
+	ili9325->enable_us = ktime_us_delta(ktime_get(), start);
 out_exit:
 	drm_dev_exit(idx);
 }
 
-static const struct drm_simple_display_pipe_funcs hy28a_funcs = {
-	.enable =  hy28a_pipe_enable,
-	.disable = ili9325_pipe_disable,
-	.update = ili9325_pipe_update,
-	.prepare_fb = drm_gem_fb_simple_display_pipe_prepare_fb,
+/* Initialization sequence from HY28A example code, uses an ILI9320 controller */
+static const struct reg_sequence hy28a_init[] = {
+	{ 0x00, 0x0000 },
+	{ 0x01, 0x0100 },		/* Driver Output Control */
+	{ 0x02, 0x0700 },		/* LCD Driver Waveform Control */
+	{ 0x03, 0x1038 },		/* Set the scan mode */
+	{ 0x04, 0x0000 },		/* Scalling Control */
+	{ 0x08, 0x0202 },		/* Display Control 2 */
+	{ 0x09, 0x0000 },		/* Display Control 3 */
+	{ 0x0a, 0x0000 },		/* Frame Cycle Contal */
+	{ 0x0c, BIT(0) },		/* Extern Display Interface Control 1 */
+	{ 0x0d, 0x0000 },		/* Frame Maker Position */
+	{ 0x0f, 0x0000, 50000 },	/* Extern Display Interface Control 2 */
+	{ 0x07, 0x0101, 50000 },	/* Display Control */
+	{ 0x10, BIT(12) | BIT(7) | BIT(6) }, /* Power Control 1 */
+	{ 0x11, 0x0007 },		/* Power Control 2 */
+	{ 0x12, BIT(8) | BIT(4) },	/* Power Control 3 */
+	{ 0x13, 0x0b00 },		/* Power Control 4 */
+	{ 0x29, 0x0000 },		/* Power Control 7 */
+	{ 0x2b, BIT(14) | BIT(4) },
+
+	{ 0x50, 0 },			/* Set X Start */
+	{ 0x51, 239 },			/* Set X End */
+	{ 0x52, 0 },			/* Set Y Start */
+	{ 0x53, 319, 50000 },		/* Set Y End */
+
+	{ 0x60, 0x2700 },		/* Driver Output Control */
+	{ 0x61, 0x0003 },		/* Base Image Display Control: REV, VLE */
+	{ 0x6a, 0x0000 },		/* Vertical Srcoll Control */
+
+	{ 0x80, 0x0000 },		/* Display Position? Partial Display 1 */
+	{ 0x81, 0x0000 },		/* RAM Address Start? Partial Display 1 */
+	{ 0x82, 0x0000 },		/* RAM Address End-Partial Display 1 */
+	{ 0x83, 0x0000 },		/* Displsy Position? Partial Display 2 */
+	{ 0x84, 0x0000 },		/* RAM Address Start? Partial Display 2 */
+	{ 0x85, 0x0000 },		/* RAM Address End? Partial Display 2 */
+
+	{ 0x90, 16 },			/* Frame Cycle Control */
+	{ 0x92, 0x0000 },		/* Panel Interface Control 2 */
+	{ 0x93, 0x0001 },		/* Panel Interface Control 3 */
+	{ 0x95, 0x0110 },		/* Frame Cycle Control */
+	{ 0x97, 0 },
+	{ 0x98, 0x0000 },		/* Frame Cycle Control */
 };
 
-/* Uses an ILI9325 controller */
-static void hy28b_pipe_enable(struct drm_simple_display_pipe *pipe,
+/* Entry mode for 0, 90, 180 and 270 degrees */
+static const u16 hy28a_entry_modes[] = {
+	0x1028,
+	0x1030,
+	0x1018,
+	0x1000,
+};
+
+static void hy28a_pipe_enable(struct drm_simple_display_pipe *pipe,
 			      struct drm_crtc_state *crtc_state,
 			      struct drm_plane_state *plane_state)
 {
 	struct tinydrm_ili9325 *ili9325 = drm_to_ili9325(pipe->crtc.dev);
-	struct device *dev = ili9325->drm.dev;
-	int idx, ret;
-
-	if (!drm_dev_enter(pipe->crtc.dev, &idx))
-		return;
 
-	ili9325_reset(ili9325);
+	ili9325_pipe_enable(ili9325, hy28a_init, ARRAY_SIZE(hy28a_init),
+			    hy28a_entry_modes, plane_state);
+}
 
-	/*
-	 * FIXME:
-	 * Apparently there are 2 versions of this display:
-	 * https://github.com/raspberrypi/linux/pull/2721
-	 *
-	 * The ILI9325D has the same ID code (0x9325) as the ILI9325, so it can't be detected at runtime.
-	 * Maybe the OTP registers are programmed?
-	 * SPI reading is controlled by register R66h on ILI9325D.
-	 */
+static const struct drm_simple_display_pipe_funcs hy28a_funcs = {
+	.enable =  hy28a_pipe_enable,
+	.disable = ili9325_pipe_disable,
+	.update = ili9325_pipe_update,
+	.prepare_fb = drm_gem_fb_simple_display_pipe_prepare_fb,
+};
 
-	/* Initialization sequence from HY28B example code */
+/*
+ * Initialization sequence from HY28B example code, uses an ILI9325 controller
+ *
+ * FIXME:
+ * Apparently there are 2 versions of this display:
+ * https://github.com/raspberrypi/linux/pull/2721
+ *
+ * The ILI9325D has the same ID code (0x9325) as the ILI9325, so it can't be detected at runtime.
+ * Maybe the OTP registers are programmed?
+ * SPI reading is controlled by register R66h on ILI9325D.
+ */
+static const struct reg_sequence hy28b_init[] = {
+	{ 0x00e7, 0x0010 },
+	{ 0x0000, 0x0001 },
+	{ 0x0001, 0x0100 },
+	{ 0x0002, 0x0700 },
+	{ 0x0003, BIT(12) | BIT(5) | BIT(4) },
+	{ 0x0004, 0x0000 },
+	{ 0x0008, 0x0207 },
+	{ 0x0009, 0x0000 },
+	{ 0x000a, 0x0000 },
+	{ 0x000c, 0x0001 },
+	{ 0x000d, 0x0000 },
+	{ 0x000f, 0x0000 },
 
-	ret = ili9325_write(ili9325, 0x00e7, 0x0010);
-	if (ret) {
-		dev_err(dev, "Failed to write register\n");
-		goto out_exit;
-	}
+	/* Power On sequence */
+	{ 0x0010, 0x0000 },
+	{ 0x0011, 0x0007 },
+	{ 0x0012, 0x0000 },
+	{ 0x0013, 0x0000, 50000 },
+
+	{ 0x0010, 0x1590 },
+	{ 0x0011, 0x0227, 50000 },
+
+	{ 0x0012, 0x009c, 50000 },
+
+	{ 0x0013, 0x1900 },
+	{ 0x0029, 0x0023 },
+	{ 0x002b, 0x000e, 50000 },
+
+	{ 0x0020, 0x0000 },
+	{ 0x0021, 0x0000, 50000 },
+
+	{ 0x0030, 0x0007 },
+	{ 0x0031, 0x0707 },
+	{ 0x0032, 0x0006 },
+	{ 0x0035, 0x0704 },
+	{ 0x0036, 0x1f04 },
+	{ 0x0037, 0x0004 },
+	{ 0x0038, 0x0000 },
+	{ 0x0039, 0x0706 },
+	{ 0x003c, 0x0701 },
+	{ 0x003d, 0x000f, 50000 },
+
+	{ 0x0050, 0 },
+	{ 0x0051, 239 },
+	{ 0x0052, 0 },
+	{ 0x0053, 319 },
+
+	{ 0x0060, 0xa700 },
+	{ 0x0061, 0x0003 },
+	{ 0x006a, 0x0000 },
+
+	{ 0x0080, 0x0000 },
+	{ 0x0081, 0x0000 },
+	{ 0x0082, 0x0000 },
+	{ 0x0083, 0x0000 },
+	{ 0x0084, 0x0000 },
+	{ 0x0085, 0x0000 },
+
+	{ 0x0090, 0x0010 },
+	{ 0x0092, 0x0000 },
+	{ 0x0093, 0x0003 },
+	{ 0x0095, 0x0110 },
+	{ 0x0097, 0x0000 },
+	{ 0x0098, 0x0000 },
+};
 
-	ili9325_write(ili9325, 0x0000, 0x0001);
-	ili9325_write(ili9325, 0x0001, 0x0100);
-	ili9325_write(ili9325, 0x0002, 0x0700);
-	ili9325_write(ili9325, 0x0003, BIT(12) | BIT(5) | BIT(4));
-	ili9325_write(ili9325, 0x0004, 0x0000);
-	ili9325_write(ili9325, 0x0008, 0x0207);
-	ili9325_write(ili9325, 0x0009, 0x0000);
-	ili9325_write(ili9325, 0x000a, 0x0000);
-	ili9325_write(ili9325, 0x000c, 0x0001);
-	ili9325_write(ili9325, 0x000d, 0x0000);
-	ili9325_write(ili9325, 0x000f, 0x0000);
+/* Entry mode for 0, 90, 180 and 270 degrees */
+static const u16 hy28b_entry_modes[] = {
+	0x1018,
+	0x1000,
+	0x1028,
+	0x1030,
+};
 
-	/* Power On sequence */
-	ili9325_write(ili9325, 0x0010, 0x0000);
-	ili9325_write(ili9325, 0x0011, 0x0007);
-	ili9325_write(ili9325, 0x0012, 0x0000);
-	ili9325_write(ili9325, 0x0013, 0x0000);
-	mdelay(50);
-
-	ili9325_write(ili9325, 0x0010, 0x1590);
-	ili9325_write(ili9325, 0x0011, 0x0227);
-	mdelay(50);
-
-	ili9325_write(ili9325, 0x0012, 0x009c);
-	mdelay(50);
-
-	ili9325_write(ili9325, 0x0013, 0x1900);
-	ili9325_write(ili9325, 0x0029, 0x0023);
-	ili9325_write(ili9325, 0x002b, 0x000e);
-	mdelay(50);
-
-	ili9325_write(ili9325, 0x0020, 0x0000);
-	ili9325_write(ili9325, 0x0021, 0x0000);
-	mdelay(50);
-
-	ili9325_write(ili9325, 0x0030, 0x0007);
-	ili9325_write(ili9325, 0x0031, 0x0707);
-	ili9325_write(ili9325, 0x0032, 0x0006);
-	ili9325_write(ili9325, 0x0035, 0x0704);
-	ili9325_write(ili9325, 0x0036, 0x1f04);
-	ili9325_write(ili9325, 0x0037, 0x0004);
-	ili9325_write(ili9325, 0x0038, 0x0000);
-	ili9325_write(ili9325, 0x0039, 0x0706);
-	ili9325_write(ili9325, 0x003c, 0x0701);
-	ili9325_write(ili9325, 0x003d, 0x000f);
-	mdelay(50);
-
-	ili9325_write(ili9325, 0x0050, 0);
-	ili9325_write(ili9325, 0x0051, 239);
-	ili9325_write(ili9325, 0x0052, 0);
-	ili9325_write(ili9325, 0x0053, 319);
-
-	ili9325_write(ili9325, 0x0060, 0xa700);
-	ili9325_write(ili9325, 0x0061, 0x0001);
-	ili9325_write(ili9325, 0x006a, 0x0000);
-
-	ili9325_write(ili9325, 0x0080, 0x0000);
-	ili9325_write(ili9325, 0x0081, 0x0000);
-	ili9325_write(ili9325, 0x0082, 0x0000);
-	ili9325_write(ili9325, 0x0083, 0x0000);
-	ili9325_write(ili9325, 0x0084, 0x0000);
-	ili9325_write(ili9325, 0x0085, 0x0000);
-
-	ili9325_write(ili9325, 0x0090, 0x0010);
-	ili9325_write(ili9325, 0x0092, 0x0000);
-	ili9325_write(ili9325, 0x0093, 0x0003);
-	ili9325_write(ili9325, 0x0095, 0x0110);
-	ili9325_write(ili9325, 0x0097, 0x0000);
-	ili9325_write(ili9325, 0x0098, 0x0000);
-
-	switch (ili9325->rotation) {
-	case 0:
-		ili9325_write(ili9325, 0x0003, 0x1018);
-		ili9325->set_win_type = 1;
-		break;
-	case 90:
-		ili9325_write(ili9325, 0x0003, 0x1000);
-		ili9325->set_win_type = 2;
-		break;
-	case 180:
-		ili9325_write(ili9325, 0x0003, 0x1028);
-		ili9325->set_win_type = 3;
-		break;
-	case 270:
-		ili9325_write(ili9325, 0x0003, 0x1030);
-		ili9325->set_win_type = 0;
-		break;
-	}
-
-	ili9325_write(ili9325, 0x0007, 0x0133);
-	mdelay(100);
+static void hy28b_pipe_enable(struct drm_simple_display_pipe *pipe,
+			      struct drm_crtc_state *crtc_state,
+			      struct drm_plane_state *plane_state)
+{
+	struct tinydrm_ili9325 *ili9325 = drm_to_ili9325(pipe->crtc.dev);
 
-	ili9325_enable_flush(ili9325, plane_state);
-out_exit:
-	drm_dev_exit(idx);
+	ili9325_pipe_enable(ili9325, hy28b_init, ARRAY_SIZE(hy28b_init),
+			    hy28b_entry_modes, plane_state);
 }
 
 static const struct drm_simple_display_pipe_funcs hy28b_funcs = {
@@ -720,29 +2291,65 @@ err_exit:
 	return ret < 0 ? ret : count;
 }
 
-static int ili9325_debugfs_reg_show(struct seq_file *m, void *d)
+/*
+ * Dump the registers from the cache, or from the controller if @hw. Registers
+ * that haven't been written since probe show as zero in the cache.
+ */
+static int ili9325_debugfs_reg_dump(struct seq_file *m, bool hw)
 {
 	struct tinydrm_ili9325 *ili9325 = m->private;
-	u16 reg, val;
+	unsigned int reg, val;
 	int idx, ret;
 
 	if (!drm_dev_enter(&ili9325->drm, &idx))
 		return -ENODEV;
 
+	mutex_lock(&ili9325->cmd_lock);
+	regcache_cache_bypass(ili9325->regmap, hw);
+
 	for (reg = 0; reg < 0xaf; reg++) {
+		if (!ili9325_readable_reg(NULL, reg))
+			continue;
+
 		seq_printf(m, "%04x: ", reg);
-		ret = ili9325_read(ili9325, reg, &val);
+		ret = regmap_read(ili9325->regmap, reg, &val);
 		if (ret)
 			seq_puts(m, "XX\n");
 		else
 			seq_printf(m, "%04x\n", val);
 	}
 
+	regcache_cache_bypass(ili9325->regmap, false);
+	mutex_unlock(&ili9325->cmd_lock);
+
 	drm_dev_exit(idx);
 
 	return 0;
 }
 
+static int ili9325_debugfs_reg_show(struct seq_file *m, void *d)
+{
+	return ili9325_debugfs_reg_dump(m, false);
+}
+
+static int ili9325_debugfs_reg_hw_show(struct seq_file *m, void *d)
+{
+	return ili9325_debugfs_reg_dump(m, true);
+}
+
+static int ili9325_debugfs_reg_hw_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ili9325_debugfs_reg_hw_show, inode->i_private);
+}
+
+static const struct file_operations ili9325_debugfs_reg_hw_fops = {
+	.owner = THIS_MODULE,
+	.open = ili9325_debugfs_reg_hw_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 static int ili9325_debugfs_reg_open(struct inode *inode,
 					   struct file *file)
 {
@@ -759,16 +2366,142 @@ static const struct file_operations ili9325_debugfs_reg_fops = {
 	.write = ili9325_debugfs_reg_write,
 };
 
+static ssize_t ili9325_debugfs_calibrate_write(struct file *file,
+					       const char __user *user_buf,
+					       size_t count, loff_t *ppos)
+{
+	struct tinydrm_ili9325 *ili9325 = file->private_data;
+	int idx, ret;
+
+	if (!drm_dev_enter(&ili9325->drm, &idx))
+		return -ENODEV;
+
+	ret = ili9325_calibrate(ili9325);
+	drm_dev_exit(idx);
+
+	return ret < 0 ? ret : count;
+}
+
+static const struct file_operations ili9325_debugfs_calibrate_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = ili9325_debugfs_calibrate_write,
+	.llseek = noop_llseek,
+};
+
+static u64 ili9325_percent(u64 part, u64 total)
+{
+	return total ? div64_u64(part * 100, total) : 0;
+}
+
+static int ili9325_debugfs_shadow_show(struct seq_file *m, void *d)
+{
+	struct tinydrm_ili9325 *ili9325 = m->private;
+	u64 flushes, identical, damaged, flushed, scrolls, lines;
+	unsigned int vscroll;
+
+	mutex_lock(&ili9325->cmd_lock);
+	flushes = ili9325->shadow_flushes;
+	identical = ili9325->shadow_identical;
+	damaged = ili9325->shadow_damaged;
+	flushed = ili9325->shadow_flushed;
+	scrolls = ili9325->scrolls;
+	lines = ili9325->scroll_lines;
+	vscroll = ili9325->vscroll;
+	mutex_unlock(&ili9325->cmd_lock);
+
+	seq_printf(m, "flushes: %llu\n", flushes);
+	seq_printf(m, "identical: %llu (%llu%%)\n", identical,
+		   ili9325_percent(identical, flushes));
+	seq_printf(m, "damaged_pixels: %llu\n", damaged);
+	seq_printf(m, "flushed_pixels: %llu (%llu%% saved)\n", flushed,
+		   ili9325_percent(damaged - flushed, damaged));
+	if (ili9325->vscroll_enabled) {
+		seq_printf(m, "scrolls: %llu\n", scrolls);
+		seq_printf(m, "scrolled_lines: %llu\n", lines);
+		seq_printf(m, "scroll_offset: %u\n", vscroll);
+	}
+
+	return 0;
+}
+
+static int ili9325_debugfs_shadow_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ili9325_debugfs_shadow_show, inode->i_private);
+}
+
+static const struct file_operations ili9325_debugfs_shadow_fops = {
+	.owner = THIS_MODULE,
+	.open = ili9325_debugfs_shadow_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int ili9325_debugfs_convert_show(struct seq_file *m, void *d)
+{
+	struct tinydrm_ili9325 *ili9325 = m->private;
+	u64 ns, bytes;
+
+	mutex_lock(&ili9325->cmd_lock);
+	ns = ili9325->convert_ns;
+	bytes = ili9325->convert_bytes;
+	mutex_unlock(&ili9325->cmd_lock);
+
+	seq_printf(m, "implementation: %s\n", tinydrm_convert_impl());
+	seq_printf(m, "bytes: %llu\n", bytes);
+	seq_printf(m, "time_us: %llu\n", div_u64(ns, NSEC_PER_USEC));
+	/* bytes per microsecond is MB/s */
+	seq_printf(m, "throughput: %llu MB/s\n", ns ? div64_u64(bytes * 1000, ns) : 0);
+
+	return 0;
+}
+
+static int ili9325_debugfs_convert_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ili9325_debugfs_convert_show, inode->i_private);
+}
+
+static const struct file_operations ili9325_debugfs_convert_fops = {
+	.owner = THIS_MODULE,
+	.open = ili9325_debugfs_convert_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 static int ili9325_debugfs_init(struct drm_minor *minor)
 {
 	struct tinydrm_ili9325 *ili9325 = drm_to_ili9325(minor->dev);
-	umode_t mode = S_IFREG | S_IWUSR;
 
-	if (ili9325->devcode)
-		mode |= S_IRUGO;
-
-	debugfs_create_file("registers", mode, minor->debugfs_root,
+	/* The cache can be dumped even if MISO isn't wired up */
+	debugfs_create_file("registers", S_IRUGO | S_IWUSR, minor->debugfs_root,
 			    ili9325, &ili9325_debugfs_reg_fops);
+	if (ili9325->devcode)
+		debugfs_create_file("registers_hw", S_IRUGO, minor->debugfs_root,
+				    ili9325, &ili9325_debugfs_reg_hw_fops);
+	debugfs_create_u32("flush_msgs", S_IRUGO, minor->debugfs_root,
+			   &ili9325->flush_msgs);
+	debugfs_create_u32("first_byte_us", S_IRUGO, minor->debugfs_root,
+			   &ili9325->first_byte_us);
+	debugfs_create_u32("enable_us", S_IRUGO, minor->debugfs_root,
+			   &ili9325->enable_us);
+	debugfs_create_u64("prepared_hits", S_IRUGO, minor->debugfs_root,
+			   &ili9325->prepared_hits);
+	debugfs_create_u64("prepared_misses", S_IRUGO, minor->debugfs_root,
+			   &ili9325->prepared_misses);
+	debugfs_create_u32("pixel_speed_hz", S_IRUGO | S_IWUSR, minor->debugfs_root,
+			   &ili9325->pixel_speed_hz);
+	if (ili9325->devcode)
+		debugfs_create_file("calibrate", S_IWUSR, minor->debugfs_root,
+				    ili9325, &ili9325_debugfs_calibrate_fops);
+	tinydrm_damage_debugfs_init(&ili9325->damage, minor->debugfs_root);
+	tinydrm_mailbox_debugfs_init(&ili9325->mbox, minor->debugfs_root);
+	debugfs_create_file("convert", S_IRUGO, minor->debugfs_root,
+			    ili9325, &ili9325_debugfs_convert_fops);
+	if (ili9325->shadow)
+		debugfs_create_file("shadow", S_IRUGO, minor->debugfs_root,
+				    ili9325, &ili9325_debugfs_shadow_fops);
 
 	return 0;
 }
@@ -788,9 +2521,14 @@ static const struct drm_display_mode ili9325_mode = {
 	DRM_SIMPLE_MODE(320, 240, 0, 0),
 };
 
+/* Big endian RGB565 is in wire order and goes out without a copy when bytes are swapped */
 static const uint32_t ili9325_formats[] = {
 	DRM_FORMAT_RGB565,
+	DRM_FORMAT_RGB565 | DRM_FORMAT_BIG_ENDIAN,
 	DRM_FORMAT_XRGB8888,
+	DRM_FORMAT_C8,
+	DRM_FORMAT_YUYV,
+	DRM_FORMAT_NV12,
 };
 
 static const uint64_t ili9325_modifiers[] = {
@@ -804,6 +2542,10 @@ static const struct drm_mode_config_funcs ili9325_mode_config_funcs = {
 	.atomic_commit = drm_atomic_helper_commit,
 };
 
+static const struct drm_mode_config_helper_funcs ili9325_mode_config_helpers = {
+	.atomic_commit_tail = ili9325_commit_tail,
+};
+
 DEFINE_DRM_GEM_CMA_FOPS(ili9325_fops);
 
 static struct drm_driver ili9325_driver = {
@@ -864,6 +2606,8 @@ static int ili9325_probe_spi(struct spi_device *spi)
 		return -ENOMEM;
 
 	ili9325->spi = spi;
+	mutex_init(&ili9325->cmd_lock);
+	spin_lock_init(&ili9325->frame_lock);
 #ifdef __LITTLE_ENDIAN
 	if (!spi_is_bpw_supported(spi, 16))
 		ili9325->swap_bytes = true;
@@ -893,13 +2637,77 @@ static int ili9325_probe_spi(struct spi_device *spi)
 		return ret;
 	}
 
-	ili9325->tx_buf = devm_kmalloc(dev, 320 * 240 * 2, GFP_KERNEL);
-	if (!ili9325->tx_buf)
+	device_property_read_u32(dev, "stripe-height", &ili9325->stripe_height);
+	if (ili9325->stripe_height > 240) {
+		dev_err(dev, "Illegal stripe-height value %u\n", ili9325->stripe_height);
+		return -EINVAL;
+	}
+
+	/* Result of a previous calibration, 0 means spi-max-frequency */
+	device_property_read_u32(dev, "pixel-speed-hz", &ili9325->pixel_speed_hz);
+
+	ret = ili9325_txbufs_init(ili9325);
+	if (ret)
+		return ret;
+
+	tinydrm_damage_init(&ili9325->damage, ILI9325_DAMAGE_SETUP_COST);
+	tinydrm_mailbox_init(&ili9325->mbox, &ili9325->damage, ili9325_fb_dirty);
+	ili9325->mbox.frame_done = ili9325_frame_done;
+	ili9325->mbox.set_rotation = ili9325_set_rotation;
+
+	/*
+	 * Keep a copy of what's in GRAM and only flush what has actually
+	 * changed. This helps clients that always flush the full frame.
+	 */
+	if (device_property_read_bool(dev, "shadow-diff")) {
+		ili9325->shadow = devm_kzalloc(dev, 320 * 240 * 2, GFP_KERNEL);
+		ili9325->diff_buf = devm_kmalloc(dev, 320 * 2, GFP_KERNEL);
+		if (!ili9325->shadow || !ili9325->diff_buf)
+			return -ENOMEM;
+
+		/*
+		 * A scrolling console or terminal is sent as a scroll offset
+		 * and the exposed lines. Needs a whole converted frame to find
+		 * the scroll distance.
+		 */
+		if (device_property_read_bool(dev, "vertical-scroll")) {
+			ili9325->frame_buf = devm_kmalloc(dev, 320 * 240 * 2, GFP_KERNEL);
+			if (!ili9325->frame_buf)
+				return -ENOMEM;
+			ili9325->vscroll_enabled = true;
+		}
+	}
+
+	/* Separate allocations so the rx buffer doesn't share a cacheline */
+	ili9325->cmd_buf = devm_kmalloc(dev, ILI9325_CMD_BUF_SIZE, GFP_KERNEL);
+	ili9325->rx_buf = devm_kmalloc(dev, ILI9325_RX_BUF_SIZE, GFP_KERNEL);
+	/* Fits an XRGB8888 line and a YUV line with its lead pixel */
+	ili9325->line_buf = devm_kmalloc(dev, (320 + 2) * 4, GFP_KERNEL);
+	if (!ili9325->cmd_buf || !ili9325->rx_buf || !ili9325->line_buf)
 		return -ENOMEM;
 
+	ili9325->regmap = devm_regmap_init(dev, &ili9325_regmap_bus, ili9325,
+					   &ili9325_regmap_config);
+	if (IS_ERR(ili9325->regmap)) {
+		dev_err(dev, "Failed to init regmap\n");
+		return PTR_ERR(ili9325->regmap);
+	}
+
+	/* Nothing is known about the window until it has been written */
+	ili9325_window_invalidate(ili9325);
+
 	device_property_read_u32(dev, "rotation", &rotation);
 	ili9325->rotation = rotation;
 
+	/*
+	 * The bootloader has already run the init sequence for this rotation and
+	 * put a splash on the display. Take it over as is.
+	 */
+	if (device_property_read_bool(dev, "bootloader-initialized")) {
+		ili9325->initialized = true;
+		ili9325->keep_splash = true;
+	}
+
 	/*
 	 * FIXME:
 	 * Rotating the mode like this won't be accepted in mainline anymore.
@@ -911,12 +2719,8 @@ static int ili9325_probe_spi(struct spi_device *spi)
 	 * rotation. Since this is a fairly new addition, don't expect much support
 	 * for this in libaries in the embedded world.
 	 *
-	 * There is a rotation property on the plane to do hw rotation, but I don't
-	 * know how it works for 90/270 rotation. Who flips the axis? How does this
-	 * really work?
-	 *
-	 * The easy solution is probably to let userspace rotate in software and
-	 * drop hw rotation support.
+	 * The rotation property on the plane is done by the controller on top of
+	 * this, see tinydrm_rotation_init().
 	 *
 	 * The fbdev emulation does not support 90/270 rotation through the
 	 * connector property. This is due to tiling issues on certain framebuffers.
@@ -934,6 +2738,7 @@ static int ili9325_probe_spi(struct spi_device *spi)
 	drm->mode_config.min_height = ili9325->mode.vdisplay;
 	drm->mode_config.max_height = ili9325->mode.vdisplay;
 	drm->mode_config.funcs = &ili9325_mode_config_funcs;
+	drm->mode_config.helper_private = &ili9325_mode_config_helpers;
 	drm->mode_config.preferred_depth = 16;
 
 	drm_connector_helper_add(&ili9325->connector, &ili9325_connector_hfuncs);
@@ -948,6 +2753,25 @@ static int ili9325_probe_spi(struct spi_device *spi)
 	if (ret)
 		return ret;
 
+	tinydrm_mailbox_set_upscale(&ili9325->mbox, &ili9325->pipe.plane);
+
+	ret = tinydrm_rotation_init(&ili9325->pipe.plane);
+	if (ret)
+		return ret;
+
+	ret = tinydrm_palette_init(&ili9325->pipe.crtc);
+	if (ret)
+		return ret;
+
+	ret = tinydrm_yuv_init(&ili9325->pipe.plane);
+	if (ret)
+		return ret;
+
+	/* vblank is when a frame has been flushed */
+	ret = drm_vblank_init(drm, 1);
+	if (ret)
+		return ret;
+
 	/* FIXME: If there's no use for devcode, this can be moved to ili9325_debugfs_init() */
 	/* We read garbage if SPI MISO is not wired up */
 	ret = ili9325_read(ili9325, 0x0000, &devcode);
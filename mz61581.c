@@ -11,31 +11,83 @@
 
 #include <linux/delay.h>
 #include <linux/gpio/consumer.h>
+#include <linux/interrupt.h>
 #include <linux/module.h>
 #include <linux/property.h>
 #include <linux/spi/spi.h>
+#include <linux/wait.h>
 
 #include <drm/drm_atomic_helper.h>
 #include <drm/drm_drv.h>
 #include <drm/drm_fb_helper.h>
+#include <drm/drm_fourcc.h>
 #include <drm/drm_gem_cma_helper.h>
 #include <drm/drm_gem_framebuffer_helper.h>
 #include <drm/drm_modeset_helper.h>
 #include <drm/drm_mipi_dbi.h>
+#include <drm/drm_vblank.h>
 
 #include <video/mipi_display.h>
 
+#include "tinydrm-helpers.h"
+
+/* Column, page and memory write commands, each with its own D/C toggling */
+#define MZ61581_DAMAGE_SETUP_COST	256
+
+#define MY BIT(7)
+#define MX BIT(6)
+#define MV BIT(5)
+#define BGR BIT(3)
+
+/* Address mode for 0, 90, 180 and 270 degrees */
+static const u8 mz61581_addr_modes[] = {
+	MY | MV,
+	MY | MX,
+	MX | MV,
+	0,
+};
+
+struct mz61581 {
+	/* Must be first, mipi_dbi_release() frees it */
+	struct mipi_dbi_dev dbidev;
+	struct tinydrm_damage damage;
+	struct tinydrm_mailbox mbox;
+
+	/* Controller is set up, it keeps its state while disabled */
+	bool initialized;
+	/* Leave the bootloader splash on until the first update */
+	bool keep_splash;
+	/* Current address mode, changed by the plane rotation */
+	u8 addr_mode;
+
+	/* Tearing effect line, optional */
+	struct gpio_desc *te;
+	wait_queue_head_t te_wait;
+	unsigned int te_seq;
+	/* Next flushed rectangle is the first one of a frame */
+	bool te_frame_start;
+};
+
+static inline struct mz61581 *drm_to_mz61581(struct drm_device *drm)
+{
+	return container_of(drm_to_mipi_dbi_dev(drm), struct mz61581, dbidev);
+}
+
 /* Renesas R61581 controller with a CPLD SPI conversion in front */
 static void mz61581_enable(struct drm_simple_display_pipe *pipe,
 			   struct drm_crtc_state *crtc_state,
 			   struct drm_plane_state *plane_state)
 {
-	struct mipi_dbi_dev *dbidev = drm_to_mipi_dbi_dev(pipe->crtc.dev);
+	struct mz61581 *mz61581 = drm_to_mz61581(pipe->crtc.dev);
+	struct mipi_dbi_dev *dbidev = &mz61581->dbidev;
 	struct mipi_dbi *dbi = &dbidev->dbi;
-	u8 addr_mode;
 
 	DRM_DEBUG_KMS("\n");
 
+	/* Disabling only turns off the backlight */
+	if (mz61581->initialized)
+		goto out_enable;
+
 	mipi_dbi_hw_reset(dbi);
 
 	mipi_dbi_command(dbi, 0xb0, 0x00);
@@ -60,49 +112,155 @@ static void mz61581_enable(struct drm_simple_display_pipe *pipe,
 	mipi_dbi_command(dbi, 0xd1, 0x03, 0x30, 0x10);
 	mipi_dbi_command(dbi, 0xd2, 0x03, 0x14, 0x04);
 
-#define MY BIT(7)
-#define MX BIT(6)
-#define MV BIT(5)
-#define BGR BIT(3)
+	mz61581->addr_mode = tinydrm_mipi_dbi_addr_mode(mz61581_addr_modes,
+							dbidev->rotation,
+							plane_state->rotation) | BGR;
+	mipi_dbi_command(dbi, MIPI_DCS_SET_ADDRESS_MODE, mz61581->addr_mode);
 
-	switch (dbidev->rotation) {
-	case 90:
-		addr_mode = MY | MX;
-		break;
-	case 180:
-		addr_mode = MX | MV;
-		break;
-	case 270:
-		addr_mode = 0;
-		break;
-	default:
-		addr_mode = MY | MV;
-		break;
+	mipi_dbi_command(dbi, MIPI_DCS_SET_DISPLAY_ON);
+	mz61581->initialized = true;
+
+out_enable:
+	if (mz61581->te)
+		drm_crtc_vblank_on(&pipe->crtc);
+
+	if (mz61581->keep_splash) {
+		mz61581->keep_splash = false;
+		tinydrm_mipi_dbi_enable_keep(dbidev);
+	} else {
+		tinydrm_mipi_dbi_enable_flush(&mz61581->mbox, crtc_state, plane_state);
 	}
-	addr_mode |= BGR;
-	mipi_dbi_command(dbi, MIPI_DCS_SET_ADDRESS_MODE, addr_mode);
+}
 
-	mipi_dbi_command(dbi, MIPI_DCS_SET_DISPLAY_ON);
+/* Called from the flush worker so it doesn't end up between window and pixels */
+static void mz61581_set_rotation(struct tinydrm_mailbox *mbox, unsigned int rotation)
+{
+	struct mz61581 *mz61581 = container_of(mbox, struct mz61581, mbox);
+	struct mipi_dbi_dev *dbidev = &mz61581->dbidev;
+	u8 addr_mode;
+	int idx;
+
+	addr_mode = tinydrm_mipi_dbi_addr_mode(mz61581_addr_modes, dbidev->rotation,
+					       rotation) | BGR;
+	if (addr_mode == mz61581->addr_mode || !dbidev->enabled)
+		return;
+
+	if (!drm_dev_enter(&dbidev->drm, &idx))
+		return;
+
+	DRM_DEBUG_KMS("Address mode 0x%02x\n", addr_mode);
+	if (!mipi_dbi_command(&dbidev->dbi, MIPI_DCS_SET_ADDRESS_MODE, addr_mode))
+		mz61581->addr_mode = addr_mode;
+
+	drm_dev_exit(idx);
+}
+
+/* The TE pulse marks the start of vertical blanking (scanline 1) */
+static irqreturn_t mz61581_te_handler(int irq, void *data)
+{
+	struct mz61581 *mz61581 = data;
 
-	mipi_dbi_enable_flush(dbidev, crtc_state, plane_state);
+	WRITE_ONCE(mz61581->te_seq, mz61581->te_seq + 1);
+	wake_up(&mz61581->te_wait);
+	drm_crtc_handle_vblank(&mz61581->dbidev.pipe.crtc);
+
+	return IRQ_HANDLED;
+}
+
+/* The first rectangle of a frame waits for the next TE pulse */
+static void mz61581_frame_start(struct tinydrm_mailbox *mbox)
+{
+	struct mz61581 *mz61581 = container_of(mbox, struct mz61581, mbox);
+
+	mz61581->te_frame_start = true;
+}
+
+/*
+ * With a TE line, GRAM writing starts on the pulse so it runs just behind the
+ * scan position. The panel scans faster than the bus can write, so it stays
+ * ahead of the writes for the rest of the frame. Rectangles flushed in the
+ * same frame go out right away.
+ */
+static void mz61581_fb_dirty(struct tinydrm_mailbox *mbox,
+			     struct drm_framebuffer *fb, struct drm_rect *rect)
+{
+	struct mz61581 *mz61581 = drm_to_mz61581(fb->dev);
+	unsigned int seq;
+
+	if (mz61581->te && mz61581->te_frame_start) {
+		seq = READ_ONCE(mz61581->te_seq);
+		if (!wait_event_timeout(mz61581->te_wait,
+					READ_ONCE(mz61581->te_seq) != seq,
+					msecs_to_jiffies(100)))
+			dev_warn_once(fb->dev->dev, "No tearing effect pulse\n");
+	}
+	mz61581->te_frame_start = false;
+
+	tinydrm_mipi_dbi_fb_dirty(mbox, fb, rect);
+}
+
+static void mz61581_frame_done(struct tinydrm_mailbox *mbox,
+			       struct list_head *events, ktime_t posted)
+{
+	struct mz61581 *mz61581 = container_of(mbox, struct mz61581, mbox);
+
+	tinydrm_mipi_dbi_frame_done(&mz61581->dbidev, mbox, events, posted);
+}
+
+static void mz61581_update(struct drm_simple_display_pipe *pipe,
+			   struct drm_plane_state *old_state)
+{
+	struct mz61581 *mz61581 = drm_to_mz61581(pipe->crtc.dev);
+
+	tinydrm_mipi_dbi_pipe_update(pipe, old_state, &mz61581->mbox);
+}
+
+static void mz61581_disable(struct drm_simple_display_pipe *pipe)
+{
+	struct mz61581 *mz61581 = drm_to_mz61581(pipe->crtc.dev);
+
+	tinydrm_mailbox_stop(&mz61581->mbox);
+	if (mz61581->te)
+		drm_crtc_vblank_off(&pipe->crtc);
+	mipi_dbi_pipe_disable(pipe);
 }
 
 static const struct drm_simple_display_pipe_funcs mz61581_funcs = {
 	.enable = mz61581_enable,
-	.disable = mipi_dbi_pipe_disable,
-	.update = mipi_dbi_pipe_update,
+	.disable = mz61581_disable,
+	.update = mz61581_update,
 	.prepare_fb = drm_gem_fb_simple_display_pipe_prepare_fb,
 };
 
+/* Big endian RGB565 is in wire order and goes out without a copy when bytes are swapped */
+static const uint32_t mz61581_formats[] = {
+	DRM_FORMAT_RGB565,
+	DRM_FORMAT_RGB565 | DRM_FORMAT_BIG_ENDIAN,
+	DRM_FORMAT_XRGB8888,
+	DRM_FORMAT_C8,
+	DRM_FORMAT_YUYV,
+	DRM_FORMAT_NV12,
+};
+
 static const struct drm_display_mode mz61581_mode = {
 	DRM_SIMPLE_MODE(480, 320, 73, 49),
 };
 
+static int mz61581_debugfs_init(struct drm_minor *minor)
+{
+	struct mz61581 *mz61581 = drm_to_mz61581(minor->dev);
+
+	tinydrm_damage_debugfs_init(&mz61581->damage, minor->debugfs_root);
+	tinydrm_mailbox_debugfs_init(&mz61581->mbox, minor->debugfs_root);
+
+	return mipi_dbi_debugfs_init(minor);
+}
+
 static struct drm_driver mz61581_driver = {
 	.driver_features	= DRIVER_GEM | DRIVER_MODESET | DRIVER_ATOMIC,
 	.release		= mipi_dbi_release,
 	DRM_GEM_CMA_VMAP_DRIVER_OPS,
-	.debugfs_init		= mipi_dbi_debugfs_init,
+	.debugfs_init		= mz61581_debugfs_init,
 	.name			= "mz61581",
 	.desc			= "Tontec mz61581",
 	.date			= "20170316",
@@ -126,24 +284,34 @@ static int mz61581_probe(struct spi_device *spi)
 {
 	struct device *dev = &spi->dev;
 	struct mipi_dbi_dev *dbidev;
+	struct mz61581 *mz61581;
 	struct drm_device *drm;
 	struct mipi_dbi *dbi;
 	struct gpio_desc *dc;
 	u32 rotation = 0;
+	size_t tx_buf_size;
 	int ret;
 
-	dbidev = kzalloc(sizeof(*dbidev), GFP_KERNEL);
-	if (!dbidev)
+	mz61581 = kzalloc(sizeof(*mz61581), GFP_KERNEL);
+	if (!mz61581)
 		return -ENOMEM;
 
+	dbidev = &mz61581->dbidev;
 	dbi = &dbidev->dbi;
 	drm = &dbidev->drm;
 	ret = devm_drm_dev_init(dev, drm, &mz61581_driver);
 	if (ret) {
-		kfree(dbi);
+		kfree(mz61581);
 		return ret;
 	}
 
+	tinydrm_damage_init(&mz61581->damage, MZ61581_DAMAGE_SETUP_COST);
+	tinydrm_mailbox_init(&mz61581->mbox, &mz61581->damage, mz61581_fb_dirty);
+	mz61581->mbox.set_rotation = mz61581_set_rotation;
+	mz61581->mbox.frame_start = mz61581_frame_start;
+	mz61581->mbox.frame_done = mz61581_frame_done;
+	init_waitqueue_head(&mz61581->te_wait);
+
 	drm_mode_config_init(drm);
 
 	dbi->reset = devm_gpiod_get_optional(dev, "reset", GPIOD_OUT_HIGH);
@@ -162,8 +330,22 @@ static int mz61581_probe(struct spi_device *spi)
 	if (IS_ERR(dbidev->backlight))
 		return PTR_ERR(dbidev->backlight);
 
+	mz61581->te = devm_gpiod_get_optional(dev, "te", GPIOD_IN);
+	if (IS_ERR(mz61581->te)) {
+		dev_err(dev, "Failed to get gpio 'te'\n");
+		return PTR_ERR(mz61581->te);
+	}
+
 	device_property_read_u32(dev, "rotation", &rotation);
 
+	/* Set up by the bootloader for this rotation, take it over as is */
+	if (device_property_read_bool(dev, "bootloader-initialized")) {
+		mz61581->initialized = true;
+		mz61581->keep_splash = true;
+		mz61581->addr_mode = tinydrm_mipi_dbi_addr_mode(mz61581_addr_modes, rotation,
+								DRM_MODE_ROTATE_0) | BGR;
+	}
+
 	ret = mipi_dbi_spi_init(spi, dbi, dc);
 	if (ret)
 		return ret;
@@ -171,10 +353,47 @@ static int mz61581_probe(struct spi_device *spi)
 	/* Reading is not supported */
 	dbi->read_commands = NULL;
 
-	ret = mipi_dbi_dev_init(dbidev, &mz61581_funcs, &mz61581_mode, rotation);
+	/* mipi_dbi_dev_init() does this for its own formats */
+	drm->mode_config.preferred_depth = 16;
+	tx_buf_size = mz61581_mode.hdisplay * mz61581_mode.vdisplay * sizeof(u16);
+	ret = mipi_dbi_dev_init_with_formats(dbidev, &mz61581_funcs,
+					     mz61581_formats, ARRAY_SIZE(mz61581_formats),
+					     &mz61581_mode, rotation, tx_buf_size);
 	if (ret)
 		return ret;
 
+	tinydrm_mailbox_set_upscale(&mz61581->mbox, &dbidev->pipe.plane);
+
+	ret = tinydrm_rotation_init(&dbidev->pipe.plane);
+	if (ret)
+		return ret;
+
+	ret = tinydrm_mipi_dbi_line_buf_init(&mz61581->mbox, drm);
+	if (ret)
+		return ret;
+
+	ret = tinydrm_palette_init(&dbidev->pipe.crtc);
+	if (ret)
+		return ret;
+
+	ret = tinydrm_yuv_init(&dbidev->pipe.plane);
+	if (ret)
+		return ret;
+
+	if (mz61581->te) {
+		ret = drm_vblank_init(drm, 1);
+		if (ret)
+			return ret;
+
+		ret = devm_request_irq(dev, gpiod_to_irq(mz61581->te),
+				       mz61581_te_handler, IRQF_TRIGGER_RISING,
+				       "mz61581-te", mz61581);
+		if (ret) {
+			dev_err(dev, "Failed to request TE interrupt\n");
+			return ret;
+		}
+	}
+
 	drm_mode_config_reset(drm);
 
 	ret = drm_dev_register(drm, 0);
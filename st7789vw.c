@@ -17,10 +17,13 @@
 #include <drm/drm_atomic_helper.h>
 #include <drm/drm_drv.h>
 #include <drm/drm_fb_helper.h>
+#include <drm/drm_fourcc.h>
 #include <drm/drm_gem_cma_helper.h>
 #include <drm/drm_gem_framebuffer_helper.h>
 #include <drm/drm_mipi_dbi.h>
 
+#include "tinydrm-helpers.h"
+
 #define ST7789VW_FRMCTR1		0xb1
 #define ST7789VW_FRMCTR2		0xb2
 #define ST7789VW_FRMCTR3		0xb3
@@ -37,26 +40,89 @@
 #define ST7789VW_MY	BIT(7)
 #define ST7789VW_MX	BIT(6)
 #define ST7789VW_MV	BIT(5)
+#define ST7789VW_ML	BIT(4)
+
+/* Address mode for 0, 90, 180 and 270 degrees */
+static const u8 st7789vw_addr_modes[] = {
+	ST7789VW_MX | ST7789VW_MV | ST7789VW_ML,
+	ST7789VW_ML,
+	ST7789VW_MY | ST7789VW_MV | ST7789VW_ML,
+	ST7789VW_MX | ST7789VW_MY | ST7789VW_ML,
+};
+
+/* The 240x240 panel shows the first 240 of the 320 memory rows */
+#define ST7789VW_ROW_OFFSET	80
+
+/* Column, page and memory write commands, each with its own D/C toggling */
+#define ST7789VW_DAMAGE_SETUP_COST	256
+
+struct st7789vw {
+	/* Must be first, mipi_dbi_release() frees it */
+	struct mipi_dbi_dev dbidev;
+	struct tinydrm_damage damage;
+	struct tinydrm_mailbox mbox;
+
+	/* Controller is set up, it keeps its state while disabled */
+	bool initialized;
+	/* Leave the bootloader splash on until the first update */
+	bool keep_splash;
+	/* Current address mode, changed by the plane rotation */
+	u8 addr_mode;
+	/* 12 bits per pixel on the bus */
+	bool rgb444;
+};
+
+static inline struct st7789vw *drm_to_st7789vw(struct drm_device *drm)
+{
+	return container_of(drm_to_mipi_dbi_dev(drm), struct st7789vw, dbidev);
+}
+
+/* Mirrored memory rows put the visible area at the end */
+static void st7789vw_set_addr_mode(struct st7789vw *st7789vw, u8 addr_mode)
+{
+	unsigned int offset = addr_mode & ST7789VW_MY ? ST7789VW_ROW_OFFSET : 0;
+
+	st7789vw->addr_mode = addr_mode;
+	/* Memory rows are framebuffer columns when rows and columns are exchanged */
+	if (addr_mode & ST7789VW_MV) {
+		st7789vw->mbox.x_offset = offset;
+		st7789vw->mbox.y_offset = 0;
+	} else {
+		st7789vw->mbox.x_offset = 0;
+		st7789vw->mbox.y_offset = offset;
+	}
+}
 
 static void jd_t18003_t01_pipe_enable(struct drm_simple_display_pipe *pipe,
 				      struct drm_crtc_state *crtc_state,
 				      struct drm_plane_state *plane_state)
 {
-	struct mipi_dbi_dev *dbidev = drm_to_mipi_dbi_dev(pipe->crtc.dev);
+	struct st7789vw *st7789vw = drm_to_st7789vw(pipe->crtc.dev);
+	struct mipi_dbi_dev *dbidev = &st7789vw->dbidev;
 	struct mipi_dbi *dbi = &dbidev->dbi;
+	u8 addr_mode;
 	int ret, idx;
 
 	if (!drm_dev_enter(pipe->crtc.dev, &idx))
 		return;
 
 	DRM_DEBUG_KMS("\n");
+
+	/* Disabling only turns off the backlight */
+	if (st7789vw->initialized)
+		goto out_enable;
+
 	ret = mipi_dbi_poweron_reset(dbidev);
 	if (ret)
 		goto out_exit;
 
-        mipi_dbi_command(dbi,0x36, 0x70);
+	addr_mode = tinydrm_mipi_dbi_addr_mode(st7789vw_addr_modes, dbidev->rotation,
+					       plane_state->rotation);
+	mipi_dbi_command(dbi, MIPI_DCS_SET_ADDRESS_MODE, addr_mode);
+	st7789vw_set_addr_mode(st7789vw, addr_mode);
 
-        mipi_dbi_command(dbi,0x3A,0x05);
+	mipi_dbi_command(dbi, MIPI_DCS_SET_PIXEL_FORMAT,
+			 st7789vw->rgb444 ? MIPI_DCS_PIXEL_FMT_12BIT : MIPI_DCS_PIXEL_FMT_16BIT);
 
         mipi_dbi_command(dbi,0xB2,0x0C,0x0C,0x00,0x33,0x33);
 
@@ -87,31 +153,109 @@ static void jd_t18003_t01_pipe_enable(struct drm_simple_display_pipe *pipe,
         mipi_dbi_command(dbi,0x29);
 
 	msleep(20);
-
-	mipi_dbi_enable_flush(dbidev, crtc_state, plane_state);
+	st7789vw->initialized = true;
+
+out_enable:
+	if (st7789vw->keep_splash) {
+		st7789vw->keep_splash = false;
+		/* The bootloader doesn't know about the 12-bit format */
+		if (st7789vw->rgb444)
+			mipi_dbi_command(dbi, MIPI_DCS_SET_PIXEL_FORMAT,
+					 MIPI_DCS_PIXEL_FMT_12BIT);
+		tinydrm_mipi_dbi_enable_keep(dbidev);
+	} else {
+		tinydrm_mipi_dbi_enable_flush(&st7789vw->mbox, crtc_state, plane_state);
+	}
 out_exit:
 	drm_dev_exit(idx);
 }
 
+/* Called from the flush worker so it doesn't end up between window and pixels */
+static void ST7789VW_set_rotation(struct tinydrm_mailbox *mbox, unsigned int rotation)
+{
+	struct st7789vw *st7789vw = container_of(mbox, struct st7789vw, mbox);
+	struct mipi_dbi_dev *dbidev = &st7789vw->dbidev;
+	u8 addr_mode;
+	int idx;
+
+	addr_mode = tinydrm_mipi_dbi_addr_mode(st7789vw_addr_modes, dbidev->rotation,
+					       rotation);
+	if (addr_mode == st7789vw->addr_mode || !dbidev->enabled)
+		return;
+
+	if (!drm_dev_enter(&dbidev->drm, &idx))
+		return;
+
+	DRM_DEBUG_KMS("Address mode 0x%02x\n", addr_mode);
+	if (!mipi_dbi_command(&dbidev->dbi, MIPI_DCS_SET_ADDRESS_MODE, addr_mode))
+		st7789vw_set_addr_mode(st7789vw, addr_mode);
+
+	drm_dev_exit(idx);
+}
+
+static void ST7789VW_frame_done(struct tinydrm_mailbox *mbox,
+				struct list_head *events, ktime_t posted)
+{
+	struct st7789vw *st7789vw = container_of(mbox, struct st7789vw, mbox);
+
+	tinydrm_mipi_dbi_frame_done(&st7789vw->dbidev, mbox, events, posted);
+}
+
+static void ST7789VW_pipe_update(struct drm_simple_display_pipe *pipe,
+				 struct drm_plane_state *old_state)
+{
+	struct st7789vw *st7789vw = drm_to_st7789vw(pipe->crtc.dev);
+
+	tinydrm_mipi_dbi_pipe_update(pipe, old_state, &st7789vw->mbox);
+}
+
+static void ST7789VW_disable(struct drm_simple_display_pipe *pipe)
+{
+	struct st7789vw *st7789vw = drm_to_st7789vw(pipe->crtc.dev);
+
+	tinydrm_mailbox_stop(&st7789vw->mbox);
+	mipi_dbi_pipe_disable(pipe);
+}
+
 static const struct drm_simple_display_pipe_funcs jd_t18003_t01_pipe_funcs = {
 	.enable		= jd_t18003_t01_pipe_enable,
-	.disable	= mipi_dbi_pipe_disable,
-	.update		= mipi_dbi_pipe_update,
+	.disable	= ST7789VW_disable,
+	.update		= ST7789VW_pipe_update,
 	.prepare_fb	= drm_gem_fb_simple_display_pipe_prepare_fb,
 };
 
+/* Big endian RGB565 is in wire order and goes out without a copy when bytes are swapped */
+static const uint32_t st7789vw_formats[] = {
+	DRM_FORMAT_RGB565,
+	DRM_FORMAT_RGB565 | DRM_FORMAT_BIG_ENDIAN,
+	DRM_FORMAT_XRGB8888,
+	DRM_FORMAT_C8,
+	DRM_FORMAT_YUYV,
+	DRM_FORMAT_NV12,
+};
+
 static const struct drm_display_mode jd_t18003_t01_mode = {
 	DRM_SIMPLE_MODE(240, 240, 20, 20),
 };
 
 DEFINE_DRM_GEM_CMA_FOPS(ST7789VW_fops);
 
+static int ST7789VW_debugfs_init(struct drm_minor *minor)
+{
+	struct st7789vw *st7789vw = drm_to_st7789vw(minor->dev);
+
+	tinydrm_damage_debugfs_init(&st7789vw->damage, minor->debugfs_root);
+	tinydrm_mailbox_debugfs_init(&st7789vw->mbox, minor->debugfs_root);
+
+	return mipi_dbi_debugfs_init(minor);
+}
+
 static struct drm_driver ST7789VW_driver = {
 	.driver_features	= DRIVER_GEM | DRIVER_MODESET | DRIVER_ATOMIC,
 	.fops			= &ST7789VW_fops,
 	.release		= mipi_dbi_release,
 	DRM_GEM_CMA_VMAP_DRIVER_OPS,
-	.debugfs_init		= mipi_dbi_debugfs_init,
+	.debugfs_init		= ST7789VW_debugfs_init,
 	.name			= "ST7789VW",
 	.desc			= "Sitronix ST7789VW",
 	.date			= "20171128",
@@ -136,24 +280,36 @@ static int ST7789VW_probe(struct spi_device *spi)
 {
 	struct device *dev = &spi->dev;
 	struct mipi_dbi_dev *dbidev;
+	struct st7789vw *st7789vw;
 	struct drm_device *drm;
 	struct mipi_dbi *dbi;
 	struct gpio_desc *dc;
 	u32 rotation = 0;
+	size_t tx_buf_size;
 	int ret;
 
-	dbidev = kzalloc(sizeof(*dbidev), GFP_KERNEL);
-	if (!dbidev)
+	st7789vw = kzalloc(sizeof(*st7789vw), GFP_KERNEL);
+	if (!st7789vw)
 		return -ENOMEM;
 
+	dbidev = &st7789vw->dbidev;
 	dbi = &dbidev->dbi;
 	drm = &dbidev->drm;
 	ret = devm_drm_dev_init(dev, drm, &ST7789VW_driver);
 	if (ret) {
-		kfree(dbidev);
+		kfree(st7789vw);
 		return ret;
 	}
 
+	tinydrm_damage_init(&st7789vw->damage, ST7789VW_DAMAGE_SETUP_COST);
+	/* A quarter fewer bytes on the bus at the cost of colour depth */
+	st7789vw->rgb444 = device_property_read_bool(dev, "rgb444");
+	tinydrm_mailbox_init(&st7789vw->mbox, &st7789vw->damage,
+			     st7789vw->rgb444 ? tinydrm_mipi_dbi_fb_dirty_rgb444 :
+						tinydrm_mipi_dbi_fb_dirty);
+	st7789vw->mbox.set_rotation = ST7789VW_set_rotation;
+	st7789vw->mbox.frame_done = ST7789VW_frame_done;
+
 	drm_mode_config_init(drm);
 
 	dbi->reset = devm_gpiod_get(dev, "reset", GPIOD_OUT_HIGH);
@@ -174,6 +330,16 @@ static int ST7789VW_probe(struct spi_device *spi)
 
 	device_property_read_u32(dev, "rotation", &rotation);
 
+	/* Set up by the bootloader for this rotation, take it over as is */
+	if (device_property_read_bool(dev, "bootloader-initialized")) {
+		st7789vw->initialized = true;
+		st7789vw->keep_splash = true;
+		st7789vw_set_addr_mode(st7789vw,
+				       tinydrm_mipi_dbi_addr_mode(st7789vw_addr_modes,
+								  rotation,
+								  DRM_MODE_ROTATE_0));
+	}
+
 	ret = mipi_dbi_spi_init(spi, dbi, dc);
 	spi->mode = SPI_MODE_3;
 	if (ret)
@@ -182,7 +348,30 @@ static int ST7789VW_probe(struct spi_device *spi)
 	/* Cannot read from Adafruit 1.8" display via SPI */
 	dbi->read_commands = NULL;
 
-	ret = mipi_dbi_dev_init(dbidev, &jd_t18003_t01_pipe_funcs, &jd_t18003_t01_mode, rotation);
+	/* mipi_dbi_dev_init() does this for its own formats */
+	drm->mode_config.preferred_depth = 16;
+	tx_buf_size = jd_t18003_t01_mode.hdisplay * jd_t18003_t01_mode.vdisplay * sizeof(u16);
+	ret = mipi_dbi_dev_init_with_formats(dbidev, &jd_t18003_t01_pipe_funcs,
+					     st7789vw_formats, ARRAY_SIZE(st7789vw_formats),
+					     &jd_t18003_t01_mode, rotation, tx_buf_size);
+	if (ret)
+		return ret;
+
+	tinydrm_mailbox_set_upscale(&st7789vw->mbox, &dbidev->pipe.plane);
+
+	ret = tinydrm_rotation_init(&dbidev->pipe.plane);
+	if (ret)
+		return ret;
+
+	ret = tinydrm_mipi_dbi_line_buf_init(&st7789vw->mbox, drm);
+	if (ret)
+		return ret;
+
+	ret = tinydrm_palette_init(&dbidev->pipe.crtc);
+	if (ret)
+		return ret;
+
+	ret = tinydrm_yuv_init(&dbidev->pipe.plane);
 	if (ret)
 		return ret;
 
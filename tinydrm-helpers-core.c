@@ -0,0 +1,2124 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Helpers shared by the tiny DRM drivers
+ *
+ * Copyright 2020 Noralf Trønnes
+ */
+
+#include <linux/backlight.h>
+#include <linux/debugfs.h>
+#include <linux/dma-buf.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/swab.h>
+#include <linux/workqueue.h>
+
+#if IS_ENABLED(CONFIG_KERNEL_MODE_NEON)
+#include <asm/neon.h>
+#include <asm/simd.h>
+#ifdef CONFIG_ARM64
+#include <asm/cpufeature.h>
+#endif
+#endif
+
+#include <drm/drm_atomic.h>
+#include <drm/drm_atomic_helper.h>
+#include <drm/drm_blend.h>
+#include <drm/drm_color_mgmt.h>
+#include <drm/drm_crtc.h>
+#include <drm/drm_damage_helper.h>
+#include <drm/drm_drv.h>
+#include <drm/drm_fb_cma_helper.h>
+#include <drm/drm_format_helper.h>
+#include <drm/drm_fourcc.h>
+#include <drm/drm_framebuffer.h>
+#include <drm/drm_gem_cma_helper.h>
+#include <drm/drm_gem_framebuffer_helper.h>
+#include <drm/drm_mipi_dbi.h>
+#include <drm/drm_plane_helper.h>
+#include <drm/drm_print.h>
+#include <drm/drm_rect.h>
+#include <drm/drm_simple_kms_helper.h>
+#include <drm/drm_vblank.h>
+
+#include <video/mipi_display.h>
+
+#include "tinydrm-helpers.h"
+#include "tinydrm-neon.h"
+
+#define CREATE_TRACE_POINTS
+#include "tinydrm-trace.h"
+
+EXPORT_TRACEPOINT_SYMBOL(tinydrm_flush_start);
+EXPORT_TRACEPOINT_SYMBOL(tinydrm_flush_end);
+EXPORT_TRACEPOINT_SYMBOL(tinydrm_convert);
+EXPORT_TRACEPOINT_SYMBOL(tinydrm_spi_submit);
+EXPORT_TRACEPOINT_SYMBOL(tinydrm_spi_complete);
+
+static const char * const tinydrm_damage_strategy_names[] = {
+	[TINYDRM_DAMAGE_BOUNDING_BOX] = "bounding-box",
+	[TINYDRM_DAMAGE_MERGED] = "merged",
+	[TINYDRM_DAMAGE_SEPARATE] = "separate",
+};
+
+/**
+ * tinydrm_damage_init - Initialize damage flush planner
+ * @damage: Damage planner
+ * @setup_cost: Default cost of flushing a rectangle in addition to its pixels
+ */
+void tinydrm_damage_init(struct tinydrm_damage *damage, unsigned int setup_cost)
+{
+	memset(damage, 0, sizeof(*damage));
+	damage->setup_cost = setup_cost;
+}
+EXPORT_SYMBOL(tinydrm_damage_init);
+
+static u64 tinydrm_rect_pixels(const struct drm_rect *rect)
+{
+	return (u64)drm_rect_width(rect) * drm_rect_height(rect);
+}
+
+static void tinydrm_rect_union(struct drm_rect *dst, const struct drm_rect *a,
+			       const struct drm_rect *b)
+{
+	dst->x1 = min(a->x1, b->x1);
+	dst->y1 = min(a->y1, b->y1);
+	dst->x2 = max(a->x2, b->x2);
+	dst->y2 = max(a->y2, b->y2);
+}
+
+static s64 tinydrm_damage_cost(struct tinydrm_damage *damage,
+			       const struct drm_rect *rect, unsigned int cpp)
+{
+	return damage->setup_cost + tinydrm_rect_pixels(rect) * cpp;
+}
+
+/**
+ * tinydrm_damage_plan - Decide which rectangles to flush
+ * @damage: Damage planner
+ * @old_state: Old plane state
+ * @state: New plane state
+ * @cpp: Bytes per pixel on the bus
+ * @rects: Returns the rectangles to flush
+ * @max_rects: Size of @rects
+ *
+ * Instead of flushing the bounding box of all damage clips, this weighs the
+ * cost of setting up a rectangle against the cost of its pixels. Neighbouring
+ * clips are merged as long as that is cheaper than flushing them separately,
+ * and the bounding box is used if that is cheapest overall.
+ *
+ * Returns:
+ * Number of rectangles to flush.
+ */
+unsigned int tinydrm_damage_plan(struct tinydrm_damage *damage,
+				 struct drm_plane_state *old_state,
+				 struct drm_plane_state *state, unsigned int cpp,
+				 struct drm_rect *rects, unsigned int max_rects)
+{
+	struct drm_atomic_helper_damage_iter iter;
+	unsigned int i, j, num = 0, num_clips = 0;
+	u64 pixels = 0, bbox_pixels;
+	struct drm_rect clip, bbox = {};
+	s64 cost = 0;
+
+	drm_atomic_helper_damage_iter_init(&iter, old_state, state);
+	drm_atomic_for_each_plane_damage(&iter, &clip) {
+		if (!num_clips)
+			bbox = clip;
+		else
+			tinydrm_rect_union(&bbox, &bbox, &clip);
+
+		if (num < max_rects)
+			rects[num++] = clip;
+		num_clips++;
+	}
+
+	if (!num_clips)
+		return 0;
+
+	/* Too many clips to consider, just flush the lot */
+	if (num_clips > max_rects)
+		goto bounding_box;
+
+	/* Merge the pair with the biggest gain until merging doesn't pay off */
+	while (num > 1) {
+		unsigned int merge_i = 0, merge_j = 0;
+		struct drm_rect merged;
+		s64 gain, best = 0;
+
+		for (i = 0; i < num; i++) {
+			for (j = i + 1; j < num; j++) {
+				tinydrm_rect_union(&merged, &rects[i], &rects[j]);
+				gain = tinydrm_damage_cost(damage, &rects[i], cpp) +
+				       tinydrm_damage_cost(damage, &rects[j], cpp) -
+				       tinydrm_damage_cost(damage, &merged, cpp);
+				if (gain > best) {
+					best = gain;
+					merge_i = i;
+					merge_j = j;
+				}
+			}
+		}
+
+		if (!best)
+			break;
+
+		tinydrm_rect_union(&rects[merge_i], &rects[merge_i], &rects[merge_j]);
+		rects[merge_j] = rects[--num];
+	}
+
+	for (i = 0; i < num; i++)
+		cost += tinydrm_damage_cost(damage, &rects[i], cpp);
+
+	if (num == 1 || cost >= tinydrm_damage_cost(damage, &bbox, cpp))
+		goto bounding_box;
+
+	if (num == num_clips)
+		damage->strategy = TINYDRM_DAMAGE_SEPARATE;
+	else
+		damage->strategy = TINYDRM_DAMAGE_MERGED;
+
+	for (i = 0; i < num; i++)
+		pixels += tinydrm_rect_pixels(&rects[i]);
+
+	goto out;
+
+bounding_box:
+	damage->strategy = TINYDRM_DAMAGE_BOUNDING_BOX;
+	rects[0] = bbox;
+	num = 1;
+	pixels = tinydrm_rect_pixels(&bbox);
+out:
+	for (i = 0; i < num; i++)
+		trace_tinydrm_damage(state->plane->dev, state->fb->base.id, &rects[i]);
+
+	bbox_pixels = tinydrm_rect_pixels(&bbox);
+	damage->count[damage->strategy]++;
+	damage->bytes_sent += pixels * cpp;
+	if (bbox_pixels > pixels)
+		damage->bytes_saved += (bbox_pixels - pixels) * cpp;
+
+	return num;
+}
+EXPORT_SYMBOL(tinydrm_damage_plan);
+
+static int tinydrm_damage_debugfs_show(struct seq_file *m, void *d)
+{
+	struct tinydrm_damage *damage = m->private;
+	unsigned int i;
+
+	seq_printf(m, "strategy: %s\n", tinydrm_damage_strategy_names[damage->strategy]);
+	for (i = 0; i < TINYDRM_DAMAGE_NUM_STRATEGIES; i++)
+		seq_printf(m, "%s: %llu\n", tinydrm_damage_strategy_names[i],
+			   damage->count[i]);
+	seq_printf(m, "bytes_sent: %llu\n", damage->bytes_sent);
+	seq_printf(m, "bytes_saved: %llu\n", damage->bytes_saved);
+
+	return 0;
+}
+
+static int tinydrm_damage_debugfs_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, tinydrm_damage_debugfs_show, inode->i_private);
+}
+
+static const struct file_operations tinydrm_damage_debugfs_fops = {
+	.owner = THIS_MODULE,
+	.open = tinydrm_damage_debugfs_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/**
+ * tinydrm_damage_debugfs_init - Create debugfs entries for the damage planner
+ * @damage: Damage planner
+ * @root: debugfs directory
+ *
+ * Creates a read-only 'damage' file with statistics and a 'damage_setup_cost'
+ * file that can be used to tune the cost model.
+ */
+void tinydrm_damage_debugfs_init(struct tinydrm_damage *damage,
+				 struct dentry *root)
+{
+	debugfs_create_file("damage", S_IRUGO, root, damage,
+			    &tinydrm_damage_debugfs_fops);
+	debugfs_create_u32("damage_setup_cost", S_IRUGO | S_IWUSR, root,
+			   &damage->setup_cost);
+}
+EXPORT_SYMBOL(tinydrm_damage_debugfs_init);
+
+static void tinydrm_stats_reset(struct tinydrm_stats *stats)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&stats->lock, flags);
+	stats->reset = ktime_get();
+	stats->frames = 0;
+	stats->dropped = 0;
+	stats->bytes = 0;
+	stats->latency_us = 0;
+	stats->convert_ns = 0;
+	stats->bus_ns = 0;
+	memset(stats->latency, 0, sizeof(stats->latency));
+	spin_unlock_irqrestore(&stats->lock, flags);
+}
+
+static void tinydrm_stats_init(struct tinydrm_stats *stats)
+{
+	spin_lock_init(&stats->lock);
+	tinydrm_stats_reset(stats);
+}
+
+/**
+ * tinydrm_stats_frame - Account a flushed frame
+ * @stats: Statistics
+ * @posted: Time the frame was posted to the mailbox
+ *
+ * Called when the last pixel of the frame has left the bus.
+ */
+void tinydrm_stats_frame(struct tinydrm_stats *stats, ktime_t posted)
+{
+	s64 us = ktime_us_delta(ktime_get(), posted);
+	unsigned int bucket = clamp_t(s64, div_s64(us, USEC_PER_MSEC), 0,
+				      TINYDRM_STATS_LATENCY_BUCKETS - 1);
+	unsigned long flags;
+
+	spin_lock_irqsave(&stats->lock, flags);
+	/* Frames posted before a reset are counted from the reset */
+	if (ktime_before(posted, stats->reset)) {
+		spin_unlock_irqrestore(&stats->lock, flags);
+		return;
+	}
+	stats->frames++;
+	stats->latency_us += us;
+	stats->latency[bucket]++;
+	spin_unlock_irqrestore(&stats->lock, flags);
+}
+EXPORT_SYMBOL(tinydrm_stats_frame);
+
+/**
+ * tinydrm_stats_convert - Account pixel conversion time
+ * @stats: Statistics
+ * @ns: Time spent converting
+ */
+void tinydrm_stats_convert(struct tinydrm_stats *stats, u64 ns)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&stats->lock, flags);
+	stats->convert_ns += ns;
+	spin_unlock_irqrestore(&stats->lock, flags);
+}
+EXPORT_SYMBOL(tinydrm_stats_convert);
+
+/**
+ * tinydrm_stats_bus - Account bus time
+ * @stats: Statistics
+ * @ns: Time the bus was busy
+ * @bytes: Pixel bytes sent in that time
+ */
+void tinydrm_stats_bus(struct tinydrm_stats *stats, u64 ns, size_t bytes)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&stats->lock, flags);
+	stats->bus_ns += ns;
+	stats->bytes += bytes;
+	spin_unlock_irqrestore(&stats->lock, flags);
+}
+EXPORT_SYMBOL(tinydrm_stats_bus);
+
+static void tinydrm_stats_dropped(struct tinydrm_stats *stats)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&stats->lock, flags);
+	stats->dropped++;
+	spin_unlock_irqrestore(&stats->lock, flags);
+}
+
+static int tinydrm_stats_debugfs_show(struct seq_file *m, void *d)
+{
+	struct tinydrm_stats *stats = m->private;
+	u64 frames, dropped, bytes, latency_us, convert_ns, bus_ns, ms, sum = 0;
+	u32 fps_rem, convert_rem, bus_rem;
+	unsigned int i, p99 = 0;
+	unsigned long flags;
+	u64 fps, convert, bus;
+
+	spin_lock_irqsave(&stats->lock, flags);
+	ms = ktime_ms_delta(ktime_get(), stats->reset);
+	frames = stats->frames;
+	dropped = stats->dropped;
+	bytes = stats->bytes;
+	latency_us = stats->latency_us;
+	convert_ns = stats->convert_ns;
+	bus_ns = stats->bus_ns;
+	for (i = 0; i < TINYDRM_STATS_LATENCY_BUCKETS && frames; i++) {
+		sum += stats->latency[i];
+		if (sum * 100 >= frames * 99) {
+			p99 = i + 1;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&stats->lock, flags);
+
+	ms = max_t(u64, ms, 1);
+	fps = div_u64_rem(div64_u64(frames * MSEC_PER_SEC * 100, ms), 100, &fps_rem);
+	/* Percentage with one decimal: ns * 1000 / (ms * 1000000) */
+	convert = div_u64_rem(div64_u64(convert_ns, ms * 1000), 10, &convert_rem);
+	bus = div_u64_rem(div64_u64(bus_ns, ms * 1000), 10, &bus_rem);
+
+	seq_printf(m, "elapsed_ms: %llu\n", ms);
+	seq_printf(m, "frames: %llu\n", frames);
+	seq_printf(m, "dropped: %llu\n", dropped);
+	seq_printf(m, "fps: %llu.%02u\n", fps, fps_rem);
+	seq_printf(m, "latency_avg_us: %llu\n", frames ? div64_u64(latency_us, frames) : 0);
+	if (p99 == TINYDRM_STATS_LATENCY_BUCKETS)
+		seq_printf(m, "latency_p99_ms: >%u\n", p99 - 1);
+	else
+		seq_printf(m, "latency_p99_ms: <%u\n", p99);
+	seq_printf(m, "convert_ms: %llu (%llu.%u%%)\n", div_u64(convert_ns, NSEC_PER_MSEC),
+		   convert, convert_rem);
+	seq_printf(m, "bus_ms: %llu (%llu.%u%% utilisation)\n", div_u64(bus_ns, NSEC_PER_MSEC),
+		   bus, bus_rem);
+	seq_printf(m, "bytes: %llu\n", bytes);
+	seq_printf(m, "bytes_per_sec: %llu\n", div64_u64(bytes * MSEC_PER_SEC, ms));
+
+	return 0;
+}
+
+static int tinydrm_stats_debugfs_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, tinydrm_stats_debugfs_show, inode->i_private);
+}
+
+static ssize_t tinydrm_stats_debugfs_write(struct file *file,
+					   const char __user *user_buf,
+					   size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+
+	tinydrm_stats_reset(m->private);
+
+	return count;
+}
+
+static const struct file_operations tinydrm_stats_debugfs_fops = {
+	.owner = THIS_MODULE,
+	.open = tinydrm_stats_debugfs_open,
+	.read = seq_read,
+	.write = tinydrm_stats_debugfs_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static bool tinydrm_rect_contains(const struct drm_rect *outer,
+				  const struct drm_rect *inner)
+{
+	return inner->x1 >= outer->x1 && inner->x2 <= outer->x2 &&
+	       inner->y1 >= outer->y1 && inner->y2 <= outer->y2;
+}
+
+static void tinydrm_mailbox_work(struct work_struct *work)
+{
+	struct tinydrm_mailbox *mbox = container_of(work, struct tinydrm_mailbox, work);
+	struct drm_rect rects[TINYDRM_DAMAGE_MAX_RECTS];
+	struct drm_framebuffer *fb;
+	unsigned int i, num, rotation;
+	LIST_HEAD(events);
+	ktime_t posted;
+
+	spin_lock(&mbox->lock);
+	fb = mbox->fb;
+	rotation = mbox->rotation;
+	mbox->flush_yuv = mbox->yuv;
+	mbox->flush_src = mbox->src;
+	mbox->flush_display = mbox->display;
+	mbox->flush_scale_x = mbox->scale_x;
+	mbox->flush_scale_y = mbox->scale_y;
+	posted = mbox->post_time;
+	if (mbox->palette_changed) {
+		memcpy(mbox->flush_palette, mbox->palette, sizeof(mbox->palette));
+		mbox->palette_changed = false;
+	}
+	num = mbox->num_rects;
+	memcpy(rects, mbox->rects, num * sizeof(*rects));
+	list_splice_init(&mbox->events, &events);
+	mbox->fb = NULL;
+	mbox->num_rects = 0;
+	spin_unlock(&mbox->lock);
+
+	if (!fb)
+		return;
+
+	if (mbox->set_rotation)
+		mbox->set_rotation(mbox, rotation);
+	if (mbox->frame_start)
+		mbox->frame_start(mbox);
+
+	for (i = 0; i < num; i++) {
+		/* Only the visible part of the framebuffer fits on the display */
+		if (!drm_rect_intersect(&rects[i], &mbox->flush_src))
+			continue;
+
+		/* Damage is in framebuffer pixels, flush on the display */
+		drm_rect_translate(&rects[i], -mbox->flush_src.x1,
+				   -mbox->flush_src.y1);
+		rects[i].x1 <<= mbox->flush_scale_x;
+		rects[i].x2 <<= mbox->flush_scale_x;
+		rects[i].y1 <<= mbox->flush_scale_y;
+		rects[i].y2 <<= mbox->flush_scale_y;
+
+		/* Never past the panel, whatever the source says */
+		if (!drm_rect_intersect(&rects[i], &mbox->flush_display))
+			continue;
+
+		mbox->flush(mbox, fb, &rects[i]);
+	}
+
+	if (mbox->frame_done)
+		mbox->frame_done(mbox, &events, posted);
+	else
+		tinydrm_stats_frame(&mbox->stats, posted);
+
+	drm_framebuffer_put(fb);
+}
+
+/**
+ * struct tinydrm_yuv - YUV to RGB conversion
+ * @coef: Multipliers with 6 fractional bits: Y, V to R, U to G, V to G and
+ *        U to B. Padded for a 128-bit NEON load.
+ * @y_offset: Black level, 16 for limited range
+ *
+ * Six fractional bits keep the sums within 16 bits so NEON can do eight
+ * pixels per instruction, and the error is lost in RGB565 anyway.
+ */
+struct tinydrm_yuv {
+	s16 coef[8];
+	u8 y_offset;
+};
+
+static const struct tinydrm_yuv tinydrm_yuv_table[2][2] = {
+	[DRM_COLOR_YCBCR_BT601] = {
+		[DRM_COLOR_YCBCR_LIMITED_RANGE] = { { 75, 102, 25, 52, 129 }, 16 },
+		[DRM_COLOR_YCBCR_FULL_RANGE] = { { 64, 90, 22, 46, 113 }, 0 },
+	},
+	[DRM_COLOR_YCBCR_BT709] = {
+		[DRM_COLOR_YCBCR_LIMITED_RANGE] = { { 75, 115, 14, 34, 135 }, 16 },
+		[DRM_COLOR_YCBCR_FULL_RANGE] = { { 64, 101, 12, 30, 119 }, 0 },
+	},
+};
+
+/**
+ * tinydrm_yuv_get - Get a YUV to RGB conversion
+ * @encoding: Color encoding
+ * @range: Color range
+ *
+ * Returns:
+ * The conversion to pass to the YUV pixel conversion functions.
+ */
+const struct tinydrm_yuv *tinydrm_yuv_get(enum drm_color_encoding encoding,
+					  enum drm_color_range range)
+{
+	return &tinydrm_yuv_table[encoding][range];
+}
+EXPORT_SYMBOL(tinydrm_yuv_get);
+
+/* The CRTC size in framebuffer orientation */
+static void tinydrm_plane_dst_size(struct drm_plane_state *state,
+				   unsigned int *width, unsigned int *height)
+{
+	*width = state->crtc_w;
+	*height = state->crtc_h;
+	if (drm_rotation_90_or_270(state->rotation))
+		swap(*width, *height);
+}
+
+/* The part of the display the plane covers, in framebuffer orientation */
+static void tinydrm_plane_display(struct drm_plane_state *state,
+				  struct drm_rect *display)
+{
+	display->x1 = 0;
+	display->y1 = 0;
+	display->x2 = drm_rect_width(&state->dst);
+	display->y2 = drm_rect_height(&state->dst);
+	if (drm_rotation_90_or_270(state->rotation))
+		swap(display->x2, display->y2);
+}
+
+/* The visible part of the framebuffer in whole pixels */
+static void tinydrm_plane_src(struct drm_plane_state *state,
+			      struct drm_rect *src)
+{
+	*src = drm_plane_state_src(state);
+	src->x1 >>= 16;
+	src->y1 >>= 16;
+	src->x2 >>= 16;
+	src->y2 >>= 16;
+}
+
+/*
+ * Grey scale when there's no gamma LUT. The core only checks the entry size
+ * of the blob, so entries past a short LUT are grey scale too.
+ */
+static void tinydrm_palette_load(u16 *palette, struct drm_property_blob *blob)
+{
+	struct drm_color_lut *lut = blob ? blob->data : NULL;
+	unsigned int i, size = blob ? drm_color_lut_size(blob) : 0;
+
+	for (i = 0; i < TINYDRM_PALETTE_SIZE; i++) {
+		u16 r = i < size ? lut[i].red : i << 8;
+		u16 g = i < size ? lut[i].green : i << 8;
+		u16 b = i < size ? lut[i].blue : i << 8;
+
+		palette[i] = (r & 0xf800) | ((g >> 5) & 0x07e0) | (b >> 11);
+	}
+}
+
+/* Pick up the gamma LUT for the next flush */
+static void tinydrm_mailbox_palette(struct tinydrm_mailbox *mbox,
+				    struct drm_crtc_state *crtc_state)
+{
+	spin_lock(&mbox->lock);
+	tinydrm_palette_load(mbox->palette, crtc_state->gamma_lut);
+	mbox->palette_changed = true;
+	spin_unlock(&mbox->lock);
+}
+
+/**
+ * tinydrm_mailbox_init - Initialize latest-wins flush worker
+ * @mbox: Mailbox
+ * @damage: Damage planner used to pick the rectangles of a commit
+ * @flush: Function that flushes a rectangle to the display
+ */
+void tinydrm_mailbox_init(struct tinydrm_mailbox *mbox,
+			  struct tinydrm_damage *damage,
+			  void (*flush)(struct tinydrm_mailbox *mbox,
+					struct drm_framebuffer *fb,
+					struct drm_rect *rect))
+{
+	INIT_WORK(&mbox->work, tinydrm_mailbox_work);
+	spin_lock_init(&mbox->lock);
+	INIT_LIST_HEAD(&mbox->events);
+	tinydrm_stats_init(&mbox->stats);
+	tinydrm_palette_load(mbox->palette, NULL);
+	tinydrm_palette_load(mbox->flush_palette, NULL);
+	mbox->damage = damage;
+	mbox->flush = flush;
+}
+EXPORT_SYMBOL(tinydrm_mailbox_init);
+
+/* Caller holds the lock */
+static bool tinydrm_mailbox_add_rect(struct tinydrm_mailbox *mbox,
+				     const struct drm_rect *rect)
+{
+	unsigned int i;
+
+	for (i = 0; i < mbox->num_rects; i++) {
+		if (tinydrm_rect_contains(&mbox->rects[i], rect))
+			return true;
+		if (tinydrm_rect_contains(rect, &mbox->rects[i])) {
+			mbox->rects[i] = *rect;
+			return true;
+		}
+	}
+
+	if (mbox->num_rects == ARRAY_SIZE(mbox->rects))
+		return false;
+
+	mbox->rects[mbox->num_rects++] = *rect;
+
+	return true;
+}
+
+static void tinydrm_mailbox_post(struct tinydrm_mailbox *mbox,
+				 struct drm_plane_state *state,
+				 const struct drm_rect *rects, unsigned int num,
+				 struct drm_pending_vblank_event *event)
+{
+	struct drm_framebuffer *old, *fb = state->fb;
+	unsigned int i, j, width, height, scale_x, scale_y;
+	struct drm_rect src, display;
+
+	tinydrm_plane_src(state, &src);
+	tinydrm_plane_display(state, &display);
+	tinydrm_plane_dst_size(state, &width, &height);
+	scale_x = ilog2(width / (state->src_w >> 16));
+	scale_y = ilog2(height / (state->src_h >> 16));
+	drm_framebuffer_get(fb);
+
+	spin_lock(&mbox->lock);
+	old = mbox->fb;
+
+	/*
+	 * The damage of a replaced frame is in its own coordinates, which
+	 * don't carry over to a framebuffer of another size, visible area,
+	 * rotation or upscaling.
+	 */
+	if (old && (old->width != fb->width || old->height != fb->height ||
+		    !drm_rect_equals(&mbox->src, &src) ||
+		    !drm_rect_equals(&mbox->display, &display) ||
+		    mbox->rotation != state->rotation ||
+		    mbox->scale_x != scale_x || mbox->scale_y != scale_y)) {
+		mbox->rects[0] = src;
+		mbox->num_rects = 1;
+	}
+
+	mbox->fb = fb;
+	mbox->src = src;
+	mbox->display = display;
+	mbox->rotation = state->rotation;
+	mbox->yuv = tinydrm_yuv_get(state->color_encoding, state->color_range);
+	mbox->scale_x = scale_x;
+	mbox->scale_y = scale_y;
+	mbox->post_time = ktime_get();
+	mbox->posted++;
+	if (old) {
+		mbox->dropped++;
+		trace_tinydrm_frame_dropped(fb->dev, old->base.id, mbox->dropped);
+	}
+
+	/* A dropped frame's event goes out with the frame that replaced it */
+	if (event)
+		list_add_tail(&event->base.link, &mbox->events);
+
+	for (i = 0; i < num; i++) {
+		if (tinydrm_mailbox_add_rect(mbox, &rects[i]))
+			continue;
+
+		/* Out of room, fall back to the bounding box of it all */
+		for (j = i; j < num; j++)
+			tinydrm_rect_union(&mbox->rects[0], &mbox->rects[0], &rects[j]);
+		for (j = 1; j < mbox->num_rects; j++)
+			tinydrm_rect_union(&mbox->rects[0], &mbox->rects[0], &mbox->rects[j]);
+		mbox->num_rects = 1;
+		break;
+	}
+	spin_unlock(&mbox->lock);
+
+	if (old) {
+		tinydrm_stats_dropped(&mbox->stats);
+		drm_framebuffer_put(old);
+	}
+
+	schedule_work(&mbox->work);
+}
+
+/**
+ * tinydrm_mailbox_update - Post a plane update
+ * @mbox: Mailbox
+ * @old_state: Old plane state
+ * @state: New plane state
+ *
+ * Plans the damage of the commit and posts it together with the framebuffer.
+ * Only the visible part of the framebuffer, the plane source, is flushed.
+ * This doesn't wait for the flush. A rotation change flushes the full
+ * framebuffer since the controller now places every pixel elsewhere, and so
+ * does a new source size which changes the upscaling, or a new palette or YUV
+ * conversion since every pixel can change colour.
+ *
+ * If &tinydrm_mailbox.frame_done is set, the page flip event of the commit is
+ * taken from the CRTC state and handed to it when the frame is flushed.
+ */
+void tinydrm_mailbox_update(struct tinydrm_mailbox *mbox,
+			    struct drm_plane_state *old_state,
+			    struct drm_plane_state *state)
+{
+	struct drm_pending_vblank_event *event = NULL;
+	struct drm_rect rects[TINYDRM_DAMAGE_MAX_RECTS];
+	struct drm_crtc_state *crtc_state;
+	unsigned int num;
+
+	if (!state->fb || !state->crtc || !state->crtc->state->active)
+		return;
+
+	/* The LUT can have changed while the display was off */
+	crtc_state = state->crtc->state;
+	if (crtc_state->color_mgmt_changed || crtc_state->active_changed)
+		tinydrm_mailbox_palette(mbox, crtc_state);
+
+	if (old_state->rotation != state->rotation ||
+	    old_state->src_w != state->src_w ||
+	    old_state->src_h != state->src_h ||
+	    old_state->color_encoding != state->color_encoding ||
+	    old_state->color_range != state->color_range ||
+	    crtc_state->color_mgmt_changed) {
+		tinydrm_plane_src(state, &rects[0]);
+		num = 1;
+	} else {
+		num = tinydrm_damage_plan(mbox->damage, old_state, state, 2,
+					  rects, ARRAY_SIZE(rects));
+	}
+
+	if (mbox->frame_done) {
+		event = state->crtc->state->event;
+		state->crtc->state->event = NULL;
+	}
+
+	/* Post even without damage so the event stays in order */
+	if (num || event)
+		tinydrm_mailbox_post(mbox, state, rects, num, event);
+}
+EXPORT_SYMBOL(tinydrm_mailbox_update);
+
+/**
+ * tinydrm_mailbox_flush_all - Flush a full framebuffer and wait for it
+ * @mbox: Mailbox
+ * @state: Plane state with the framebuffer
+ *
+ * Used when the display is enabled. Going through the worker keeps it from
+ * racing a commit that was posted before the display was ready. The palette
+ * is reloaded since updates aren't posted while the display is off.
+ */
+void tinydrm_mailbox_flush_all(struct tinydrm_mailbox *mbox,
+			       struct drm_plane_state *state)
+{
+	struct drm_rect rect;
+
+	if (state->crtc)
+		tinydrm_mailbox_palette(mbox, state->crtc->state);
+	tinydrm_plane_src(state, &rect);
+	tinydrm_mailbox_post(mbox, state, &rect, 1, NULL);
+	flush_work(&mbox->work);
+}
+EXPORT_SYMBOL(tinydrm_mailbox_flush_all);
+
+/**
+ * tinydrm_mailbox_stop - Stop flushing
+ * @mbox: Mailbox
+ *
+ * Waits for a running flush to finish and drops the pending one. Its page
+ * flip events are still handed to &tinydrm_mailbox.frame_done.
+ * Used when the display is disabled.
+ */
+void tinydrm_mailbox_stop(struct tinydrm_mailbox *mbox)
+{
+	struct drm_framebuffer *fb;
+	LIST_HEAD(events);
+
+	cancel_work_sync(&mbox->work);
+
+	spin_lock(&mbox->lock);
+	fb = mbox->fb;
+	list_splice_init(&mbox->events, &events);
+	mbox->fb = NULL;
+	mbox->num_rects = 0;
+	spin_unlock(&mbox->lock);
+
+	if (!list_empty(&events))
+		mbox->frame_done(mbox, &events, 0);
+
+	if (fb)
+		drm_framebuffer_put(fb);
+}
+EXPORT_SYMBOL(tinydrm_mailbox_stop);
+
+/* The plane helpers are copied to the mailbox the first time they change */
+static struct drm_plane_helper_funcs *
+tinydrm_mailbox_plane_funcs(struct tinydrm_mailbox *mbox, struct drm_plane *plane)
+{
+	if (plane->helper_private != &mbox->plane_funcs) {
+		mbox->plane_funcs = *plane->helper_private;
+		drm_plane_helper_add(plane, &mbox->plane_funcs);
+	}
+
+	return &mbox->plane_funcs;
+}
+
+/* Whole factors of 1, 2 or 4 since the pixels are replicated */
+static bool tinydrm_upscale_valid(unsigned int dst, unsigned int src)
+{
+	return dst == src || dst == src * 2 || dst == src * 4;
+}
+
+/*
+ * Same as the simple display pipe check except that the source can be 1/2 or
+ * 1/4 of the CRTC size in each direction.
+ */
+static int tinydrm_upscale_check(struct drm_plane *plane,
+				 struct drm_plane_state *state)
+{
+	struct drm_simple_display_pipe *pipe =
+		container_of(plane, struct drm_simple_display_pipe, plane);
+	struct drm_crtc_state *crtc_state;
+	unsigned int width, height;
+	int ret;
+
+	crtc_state = drm_atomic_get_new_crtc_state(state->state, &pipe->crtc);
+	ret = drm_atomic_helper_check_plane_state(state, crtc_state,
+						  DRM_PLANE_HELPER_NO_SCALING / 4,
+						  DRM_PLANE_HELPER_NO_SCALING,
+						  false, true);
+	if (ret)
+		return ret;
+
+	if (!state->visible)
+		return 0;
+
+	tinydrm_plane_dst_size(state, &width, &height);
+	if ((state->src_w | state->src_h) & 0xffff ||
+	    !tinydrm_upscale_valid(width, state->src_w >> 16) ||
+	    !tinydrm_upscale_valid(height, state->src_h >> 16))
+		return -EINVAL;
+
+	if (!pipe->funcs || !pipe->funcs->check)
+		return 0;
+
+	return pipe->funcs->check(pipe, state, crtc_state);
+}
+
+/**
+ * tinydrm_mailbox_set_upscale - Let the plane upscale by whole factors
+ * @mbox: Mailbox
+ * @plane: Plane of a simple display pipe, already initialized with its helpers
+ *
+ * The framebuffer can be 1/2 or 1/4 of the display size in each direction
+ * and the pixels are replicated when they're copied for the bus. Rendering
+ * at a quarter of the pixels saves both CPU time and memory on slow SoCs.
+ * Damage is flushed in display pixels, and the flush function has to upscale
+ * the framebuffer, see &tinydrm_mailbox.flush_scale_x.
+ */
+void tinydrm_mailbox_set_upscale(struct tinydrm_mailbox *mbox,
+				 struct drm_plane *plane)
+{
+	struct drm_mode_config *config = &plane->dev->mode_config;
+
+	tinydrm_mailbox_plane_funcs(mbox, plane)->atomic_check = tinydrm_upscale_check;
+
+	config->min_width /= 4;
+	config->min_height /= 4;
+}
+EXPORT_SYMBOL(tinydrm_mailbox_set_upscale);
+
+/**
+ * tinydrm_mailbox_debugfs_init - Create debugfs entries for the mailbox
+ * @mbox: Mailbox
+ * @root: debugfs directory
+ *
+ * Creates a 'stats' file with flush statistics since the last reset. Writing
+ * anything to it resets the statistics.
+ */
+void tinydrm_mailbox_debugfs_init(struct tinydrm_mailbox *mbox,
+				  struct dentry *root)
+{
+	debugfs_create_u64("frames_posted", S_IRUGO, root, &mbox->posted);
+	debugfs_create_u64("frames_dropped", S_IRUGO, root, &mbox->dropped);
+	debugfs_create_file("stats", S_IRUGO | S_IWUSR, root, &mbox->stats,
+			    &tinydrm_stats_debugfs_fops);
+}
+EXPORT_SYMBOL(tinydrm_mailbox_debugfs_init);
+
+/**
+ * tinydrm_rotation_init - Add a rotation property to the plane
+ * @plane: Plane
+ *
+ * Rotation and reflection are done by the controller when it writes the
+ * pixels to its memory, so they come without any CPU cost. The framebuffer
+ * size limits are widened to fit a framebuffer rotated by 90 or 270 degrees.
+ * A framebuffer can then be bigger than the display, the mailbox only flushes
+ * the plane source which the atomic check has fitted to the CRTC.
+ *
+ * Returns:
+ * Zero on success, negative error code on failure.
+ */
+int tinydrm_rotation_init(struct drm_plane *plane)
+{
+	struct drm_mode_config *config = &plane->dev->mode_config;
+	int min = min(config->min_width, config->min_height);
+	int max = max(config->max_width, config->max_height);
+
+	config->min_width = min;
+	config->min_height = min;
+	config->max_width = max;
+	config->max_height = max;
+
+	return drm_plane_create_rotation_property(plane, DRM_MODE_ROTATE_0,
+						  DRM_MODE_ROTATE_MASK |
+						  DRM_MODE_REFLECT_MASK);
+}
+EXPORT_SYMBOL(tinydrm_rotation_init);
+
+/**
+ * tinydrm_palette_init - Add a palette for the C8 format
+ * @crtc: CRTC
+ *
+ * The palette is set through the GAMMA_LUT property of the CRTC and is only
+ * used for C8 framebuffers. Pixels are expanded to RGB565 through it while
+ * they are copied for the flush. Without a LUT the palette is grey scale.
+ *
+ * Returns:
+ * Zero on success, negative error code on failure.
+ */
+int tinydrm_palette_init(struct drm_crtc *crtc)
+{
+	int ret;
+
+	ret = drm_mode_crtc_set_gamma_size(crtc, TINYDRM_PALETTE_SIZE);
+	if (ret)
+		return ret;
+
+	drm_crtc_enable_color_mgmt(crtc, 0, false, TINYDRM_PALETTE_SIZE);
+
+	return 0;
+}
+EXPORT_SYMBOL(tinydrm_palette_init);
+
+/**
+ * tinydrm_yuv_init - Add YUV color encoding and range properties to the plane
+ * @plane: Plane
+ *
+ * Lets userspace pick BT.601 or BT.709 in limited or full range for YUV
+ * framebuffers. The default is BT.601 limited range.
+ *
+ * Returns:
+ * Zero on success, negative error code on failure.
+ */
+int tinydrm_yuv_init(struct drm_plane *plane)
+{
+	return drm_plane_create_color_properties(plane,
+						 BIT(DRM_COLOR_YCBCR_BT601) |
+						 BIT(DRM_COLOR_YCBCR_BT709),
+						 BIT(DRM_COLOR_YCBCR_LIMITED_RANGE) |
+						 BIT(DRM_COLOR_YCBCR_FULL_RANGE),
+						 DRM_COLOR_YCBCR_BT601,
+						 DRM_COLOR_YCBCR_LIMITED_RANGE);
+}
+EXPORT_SYMBOL(tinydrm_yuv_init);
+
+/**
+ * tinydrm_rotation_index - Combine the panel rotation with a plane rotation
+ * @degrees: Panel rotation from the rotation property
+ * @rotation: Plane rotation, reflection bits are ignored
+ *
+ * Both rotations are counter clockwise so they add up.
+ *
+ * Returns:
+ * Index into a table of controller settings for 0, 90, 180 and 270 degrees.
+ */
+unsigned int tinydrm_rotation_index(unsigned int degrees, unsigned int rotation)
+{
+	return (degrees / 90 + ilog2(rotation & DRM_MODE_ROTATE_MASK)) % 4;
+}
+EXPORT_SYMBOL(tinydrm_rotation_index);
+
+/* Expand C8 pixels through the palette */
+static int tinydrm_c8_buf_copy(u16 *dst, struct drm_framebuffer *fb,
+			       struct drm_rect *clip, const u16 *palette, bool swap,
+			       u8 *line)
+{
+	struct drm_gem_object *gem = drm_gem_fb_get_obj(fb, 0);
+	struct drm_gem_cma_object *cma_obj = to_drm_gem_cma_obj(gem);
+	struct dma_buf_attachment *import_attach = gem->import_attach;
+	unsigned int width = drm_rect_width(clip);
+	void *src = cma_obj->vaddr;
+	unsigned int y;
+	int ret = 0;
+
+	if (import_attach) {
+		ret = dma_buf_begin_cpu_access(import_attach->dmabuf,
+					       DMA_FROM_DEVICE);
+		if (ret)
+			return ret;
+	}
+
+	src += clip->y1 * fb->pitches[0] + clip->x1;
+
+	for (y = clip->y1; y < clip->y2; y++) {
+		/* The cma memory is write-combined so reads are uncached */
+		memcpy(line, src, width);
+		tinydrm_c8_to_rgb565_line(dst, line, width, palette, swap);
+		src += fb->pitches[0];
+		dst += width;
+	}
+
+	if (import_attach)
+		ret = dma_buf_end_cpu_access(import_attach->dmabuf,
+					     DMA_FROM_DEVICE);
+
+	return ret;
+}
+
+/* The pixels behind a rectangle on the display, relative to the visible area */
+static void tinydrm_upscale_clip(struct drm_rect *src, const struct drm_rect *rect,
+				 unsigned int scale_x, unsigned int scale_y)
+{
+	src->x1 = rect->x1 >> scale_x;
+	src->x2 = ((rect->x2 - 1) >> scale_x) + 1;
+	src->y1 = rect->y1 >> scale_y;
+	src->y2 = ((rect->y2 - 1) >> scale_y) + 1;
+}
+
+/**
+ * tinydrm_mailbox_fb_clip - Framebuffer clip behind a rectangle on the display
+ * @mbox: Mailbox
+ * @clip: Returns the framebuffer clip
+ * @rect: Rectangle passed to &tinydrm_mailbox.flush
+ *
+ * Takes the upscaling and the position of the visible area in the framebuffer
+ * being flushed into account. Only valid in the flush function.
+ */
+void tinydrm_mailbox_fb_clip(struct tinydrm_mailbox *mbox, struct drm_rect *clip,
+			     const struct drm_rect *rect)
+{
+	tinydrm_upscale_clip(clip, rect, mbox->flush_scale_x, mbox->flush_scale_y);
+	drm_rect_translate(clip, mbox->flush_src.x1, mbox->flush_src.y1);
+}
+EXPORT_SYMBOL(tinydrm_mailbox_fb_clip);
+
+/**
+ * tinydrm_upscale - Replicate RGB565 pixels in place
+ * @buf: Pixels of the framebuffer clip on entry, pixels of @rect on return
+ * @rect: Rectangle on the display
+ * @scale_x: log2 of the horizontal upscaling
+ * @scale_y: log2 of the vertical upscaling
+ *
+ * @buf has to hold the pixels of @rect. A display pixel never comes from a
+ * source pixel further into the buffer, so working backwards from the last
+ * pixel reads every source pixel before it is overwritten. Lines from the
+ * same source line are copied.
+ */
+void tinydrm_upscale(u16 *buf, const struct drm_rect *rect,
+		     unsigned int scale_x, unsigned int scale_y)
+{
+	unsigned int width = drm_rect_width(rect);
+	int x, y, row, prev = -1;
+	unsigned int src_width;
+	struct drm_rect src;
+	const u16 *line;
+	u16 *out;
+
+	tinydrm_upscale_clip(&src, rect, scale_x, scale_y);
+	src_width = drm_rect_width(&src);
+
+	for (y = rect->y2 - 1; y >= rect->y1; y--) {
+		row = (y >> scale_y) - src.y1;
+		out = buf + (y - rect->y1) * width;
+
+		if (row == prev) {
+			memcpy(out, out + width, width * sizeof(u16));
+			continue;
+		}
+		prev = row;
+
+		line = buf + row * src_width;
+		for (x = rect->x2 - 1; x >= rect->x1; x--)
+			out[x - rect->x1] = line[(x >> scale_x) - src.x1];
+	}
+}
+EXPORT_SYMBOL(tinydrm_upscale);
+
+/* Begin or end CPU access to the imported buffers behind a framebuffer */
+static int tinydrm_fb_cpu_access(struct drm_framebuffer *fb, bool begin)
+{
+	struct drm_gem_object *first = drm_gem_fb_get_obj(fb, 0);
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < fb->format->num_planes; i++) {
+		struct drm_gem_object *gem = drm_gem_fb_get_obj(fb, i);
+
+		if (!gem->import_attach || (i && gem == first))
+			continue;
+
+		if (begin)
+			ret = dma_buf_begin_cpu_access(gem->import_attach->dmabuf,
+						       DMA_FROM_DEVICE);
+		else
+			ret = dma_buf_end_cpu_access(gem->import_attach->dmabuf,
+						     DMA_FROM_DEVICE);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Convert one line of a YUV clip. Pixel pairs share chroma so the line is
+ * fetched from the even column at or before the start of the clip. The clip
+ * is inside the visible area which has an even width, so rounding up the end
+ * column stays inside the framebuffer.
+ *
+ * @line holds (width + 2) * 4 bytes: the fetched source followed by room for
+ * the pixels when a leading odd pixel has to be dropped.
+ */
+static void tinydrm_yuv_line(u16 *dst, struct drm_framebuffer *fb,
+			     struct drm_rect *clip, unsigned int y,
+			     const struct tinydrm_yuv *yuv, bool swap, u8 *line)
+{
+	struct drm_gem_cma_object *cma_obj = drm_fb_cma_get_gem_obj(fb, 0);
+	unsigned int x0 = round_down(clip->x1, 2);
+	unsigned int lead = clip->x1 - x0;
+	unsigned int pixels = drm_rect_width(clip) + lead;
+	unsigned int pairs = DIV_ROUND_UP(pixels, 2);
+	u16 *out = lead ? (u16 *)(line + pairs * 4) : dst;
+	void *src = cma_obj->vaddr + fb->offsets[0] + y * fb->pitches[0];
+
+	/* The cma memory is write-combined so reads are uncached */
+	if (fb->format->format == DRM_FORMAT_YUYV) {
+		memcpy(line, src + x0 * 2, pairs * 4);
+		tinydrm_yuyv_to_rgb565_line(out, line, pixels, yuv, swap);
+	} else {
+		memcpy(line, src + x0, pairs * 2);
+		cma_obj = drm_fb_cma_get_gem_obj(fb, 1);
+		src = cma_obj->vaddr + fb->offsets[1] + y / 2 * fb->pitches[1];
+		memcpy(line + pairs * 2, src + x0, pairs * 2);
+		tinydrm_nv12_to_rgb565_line(out, line, line + pairs * 2, pixels,
+					    yuv, swap);
+	}
+
+	if (lead)
+		memcpy(dst, out + 1, (pixels - 1) * sizeof(u16));
+}
+
+/**
+ * tinydrm_yuv_buf_copy - Convert a YUV clip to RGB565
+ * @dst: Destination
+ * @fb: DRM_FORMAT_YUYV or DRM_FORMAT_NV12 framebuffer
+ * @clip: Clip rectangle
+ * @yuv: Conversion, see &tinydrm_mailbox.flush_yuv
+ * @swap: Swap bytes
+ * @line: Line buffer of at least (width + 2) * 4 bytes for the widest clip
+ *
+ * The pixels are converted and swapped in one pass over the clip, so video
+ * doesn't have to be converted to RGB in userspace first.
+ *
+ * Returns:
+ * Zero on success, negative error code on failure.
+ */
+int tinydrm_yuv_buf_copy(u16 *dst, struct drm_framebuffer *fb,
+			 struct drm_rect *clip, const struct tinydrm_yuv *yuv,
+			 bool swap, void *line)
+{
+	unsigned int width = drm_rect_width(clip);
+	unsigned int y;
+	int ret;
+
+	ret = tinydrm_fb_cpu_access(fb, true);
+	if (ret)
+		return ret;
+
+	for (y = clip->y1; y < clip->y2; y++) {
+		tinydrm_yuv_line(dst, fb, clip, y, yuv, swap, line);
+		dst += width;
+	}
+
+	return tinydrm_fb_cpu_access(fb, false);
+}
+EXPORT_SYMBOL(tinydrm_yuv_buf_copy);
+
+/* mipi_dbi_buf_copy() doesn't know about big endian RGB565 */
+static int tinydrm_rgb565_buf_copy(void *dst, struct drm_framebuffer *fb,
+				   struct drm_rect *clip, bool swap)
+{
+	struct drm_gem_object *gem = drm_gem_fb_get_obj(fb, 0);
+	struct drm_gem_cma_object *cma_obj = to_drm_gem_cma_obj(gem);
+	struct dma_buf_attachment *import_attach = gem->import_attach;
+	int ret = 0;
+
+	if (import_attach) {
+		ret = dma_buf_begin_cpu_access(import_attach->dmabuf,
+					       DMA_FROM_DEVICE);
+		if (ret)
+			return ret;
+	}
+
+	if (swap)
+		drm_fb_swab16(dst, cma_obj->vaddr, fb, clip);
+	else
+		drm_fb_memcpy(dst, cma_obj->vaddr, fb, clip);
+
+	if (import_attach)
+		ret = dma_buf_end_cpu_access(import_attach->dmabuf,
+					     DMA_FROM_DEVICE);
+
+	return ret;
+}
+
+/* Reduce a line of pixels to 12-bit RGB444 values */
+static void tinydrm_rgb444_line(u16 *dst, const void *src, unsigned int pixels,
+				u32 format, const u16 *palette)
+{
+	const u16 *src16 = src;
+	const u32 *src32 = src;
+	const u8 *src8 = src;
+	unsigned int x;
+	u32 val;
+
+	for (x = 0; x < pixels; x++) {
+		if (format == DRM_FORMAT_XRGB8888) {
+			val = src32[x];
+			dst[x] = (val >> 12 & 0xf00) | (val >> 8 & 0xf0) | (val >> 4 & 0xf);
+			continue;
+		}
+
+		if (format == DRM_FORMAT_C8)
+			val = palette[src8[x]];
+		else if (format & DRM_FORMAT_BIG_ENDIAN)
+			val = swab16(src16[x]);
+		else
+			val = src16[x];
+		dst[x] = (val >> 4 & 0xf00) | (val >> 3 & 0xf0) | (val >> 1 & 0xf);
+	}
+}
+
+/* The bus sends 16-bit words, pad to whole words. Returns the length. */
+static size_t tinydrm_rgb444_words(u8 *buf, size_t len, bool words)
+{
+	size_t i;
+
+	if (words) {
+		if (len & 1)
+			buf[len++] = 0;
+		for (i = 0; i < len; i += 2)
+			be16_to_cpus((u16 *)(buf + i));
+	}
+
+	return len;
+}
+
+/*
+ * Pack the pixels as RGB444 with two pixels in three bytes: R0G0 B0R1 G1B1.
+ * An odd number of pixels ends with half a byte of padding. If the bus sends
+ * the pixel data as 16-bit words, the bytes are paired up in CPU order and
+ * padded to a whole word.
+ *
+ * Returns the number of bytes or a negative error code.
+ */
+static int tinydrm_rgb444_buf_copy(u8 *dst, struct drm_framebuffer *fb,
+				   struct drm_rect *clip, const u16 *palette,
+				   const struct tinydrm_yuv *yuv, bool words,
+				   void *line)
+{
+	struct drm_gem_object *gem = drm_gem_fb_get_obj(fb, 0);
+	struct drm_gem_cma_object *cma_obj = to_drm_gem_cma_obj(gem);
+	unsigned int width = drm_rect_width(clip);
+	unsigned int cpp = fb->format->cpp[0];
+	unsigned int x, y, n = 0;
+	u16 *pixels, held = 0;
+	u8 *start = dst;
+	size_t size;
+	int ret, err;
+	void *src;
+
+	size = fb->format->is_yuv ? (width + 2) * 4 : width * cpp;
+	pixels = line + size;
+
+	ret = tinydrm_fb_cpu_access(fb, true);
+	if (ret)
+		return ret;
+
+	src = cma_obj->vaddr + clip->y1 * fb->pitches[0] + clip->x1 * cpp;
+
+	for (y = clip->y1; y < clip->y2; y++) {
+		if (fb->format->is_yuv) {
+			tinydrm_yuv_line(pixels, fb, clip, y, yuv, false, line);
+			tinydrm_rgb444_line(pixels, pixels, width,
+					    DRM_FORMAT_RGB565, NULL);
+		} else {
+			/* The cma memory is write-combined so reads are uncached */
+			memcpy(line, src, width * cpp);
+			tinydrm_rgb444_line(pixels, line, width,
+					    fb->format->format, palette);
+		}
+
+		for (x = 0; x < width; x++) {
+			if (!(n++ & 1)) {
+				held = pixels[x];
+				continue;
+			}
+			*dst++ = held >> 4;
+			*dst++ = (held & 0xf) << 4 | pixels[x] >> 8;
+			*dst++ = pixels[x];
+		}
+
+		src += fb->pitches[0];
+	}
+
+	if (n & 1) {
+		*dst++ = held >> 4;
+		*dst++ = (held & 0xf) << 4;
+	}
+
+	ret = tinydrm_rgb444_words(start, dst - start, words);
+
+	err = tinydrm_fb_cpu_access(fb, false);
+	if (err)
+		ret = err;
+
+	return ret;
+}
+
+/*
+ * Pack RGB565 pixels in CPU order as RGB444 in place. Each pair of pixels is
+ * read before its three bytes are written, which never reach past the pair.
+ */
+static size_t tinydrm_rgb444_pack(void *buf, unsigned int pixels, bool words)
+{
+	u16 *src = buf;
+	u8 *dst = buf;
+	unsigned int x;
+	u16 a, b;
+
+	tinydrm_rgb444_line(src, src, pixels, DRM_FORMAT_RGB565, NULL);
+
+	for (x = 0; x + 1 < pixels; x += 2) {
+		a = src[x];
+		b = src[x + 1];
+		*dst++ = a >> 4;
+		*dst++ = (a & 0xf) << 4 | b >> 8;
+		*dst++ = b;
+	}
+
+	if (pixels & 1) {
+		a = src[x];
+		*dst++ = a >> 4;
+		*dst++ = (a & 0xf) << 4;
+	}
+
+	return tinydrm_rgb444_words(buf, dst - (u8 *)buf, words);
+}
+
+static void __tinydrm_mipi_dbi_fb_dirty(struct tinydrm_mailbox *mbox,
+					struct drm_framebuffer *fb,
+					struct drm_rect *rect, bool rgb444)
+{
+	struct drm_gem_object *gem = drm_gem_fb_get_obj(fb, 0);
+	struct drm_gem_cma_object *cma_obj = to_drm_gem_cma_obj(gem);
+	struct mipi_dbi_dev *dbidev = drm_to_mipi_dbi_dev(fb->dev);
+	unsigned int height = rect->y2 - rect->y1;
+	unsigned int width = rect->x2 - rect->x1;
+	unsigned int scale_x = mbox->flush_scale_x;
+	unsigned int scale_y = mbox->flush_scale_y;
+	struct mipi_dbi *dbi = &dbidev->dbi;
+	size_t len = width * height * 2;
+	bool swap = dbi->swap_bytes;
+	bool rgb565, scaled, contiguous;
+	unsigned int xs, xe, ys, ye;
+	struct drm_rect clip;
+	int idx, ret = 0;
+	ktime_t start;
+	void *tr;
+
+	if (!dbidev->enabled)
+		return;
+
+	if (!drm_dev_enter(fb->dev, &idx))
+		return;
+
+	tinydrm_mailbox_fb_clip(mbox, &clip, rect);
+	scaled = scale_x || scale_y;
+
+	/* Upscaled RGB444 is converted to RGB565 and packed after scaling */
+	if (scaled && rgb444)
+		swap = false;
+
+	rgb565 = fb->format->cpp[0] == 2 && !fb->format->is_yuv;
+	if (rgb565)
+		swap = tinydrm_rgb565_swap(fb->format->format, swap);
+	contiguous = !scaled && width == fb->width &&
+		     fb->pitches[0] == width * 2;
+
+	DRM_DEBUG_KMS("Flushing [FB:%d] " DRM_RECT_FMT "\n", fb->base.id, DRM_RECT_ARG(rect));
+	trace_tinydrm_flush_start(fb->dev, fb->base.id, rect);
+
+	if (rgb444 || !dbi->dc || !contiguous || swap || !rgb565) {
+		u64 ns;
+
+		start = ktime_get();
+		tr = dbidev->tx_buf;
+		if (rgb444 && !scaled) {
+			ret = tinydrm_rgb444_buf_copy(dbidev->tx_buf, fb, &clip,
+						      mbox->flush_palette,
+						      mbox->flush_yuv,
+						      !dbi->swap_bytes,
+						      mbox->line_buf);
+			if (ret >= 0) {
+				len = ret;
+				ret = 0;
+			}
+		} else if (fb->format->format == DRM_FORMAT_C8) {
+			ret = tinydrm_c8_buf_copy(dbidev->tx_buf, fb, &clip,
+						  mbox->flush_palette, swap,
+						  mbox->line_buf);
+		} else if (fb->format->is_yuv) {
+			ret = tinydrm_yuv_buf_copy(dbidev->tx_buf, fb, &clip,
+						   mbox->flush_yuv, swap,
+						   mbox->line_buf);
+		} else if (rgb565) {
+			ret = tinydrm_rgb565_buf_copy(dbidev->tx_buf, fb, &clip, swap);
+		} else {
+			ret = mipi_dbi_buf_copy(dbidev->tx_buf, fb, &clip, swap);
+		}
+		if (ret)
+			goto err_msg;
+		if (scaled) {
+			tinydrm_upscale(dbidev->tx_buf, rect, scale_x, scale_y);
+			if (rgb444)
+				len = tinydrm_rgb444_pack(dbidev->tx_buf,
+							  width * height,
+							  !dbi->swap_bytes);
+		}
+		ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+		trace_tinydrm_convert(fb->dev, fb->format->format, width, height, ns);
+		tinydrm_stats_convert(&mbox->stats, ns);
+	} else {
+		tr = cma_obj->vaddr + clip.y1 * fb->pitches[0];
+	}
+
+	start = ktime_get();
+	xs = rect->x1 + mbox->x_offset;
+	xe = rect->x2 - 1 + mbox->x_offset;
+	ys = rect->y1 + mbox->y_offset;
+	ye = rect->y2 - 1 + mbox->y_offset;
+	mipi_dbi_command(dbi, MIPI_DCS_SET_COLUMN_ADDRESS,
+			 (xs >> 8) & 0xff, xs & 0xff, (xe >> 8) & 0xff, xe & 0xff);
+	mipi_dbi_command(dbi, MIPI_DCS_SET_PAGE_ADDRESS,
+			 (ys >> 8) & 0xff, ys & 0xff, (ye >> 8) & 0xff, ye & 0xff);
+
+	ret = mipi_dbi_command_buf(dbi, MIPI_DCS_WRITE_MEMORY_START, tr, len);
+	tinydrm_stats_bus(&mbox->stats, ktime_to_ns(ktime_sub(ktime_get(), start)),
+			  ret ? 0 : len);
+err_msg:
+	trace_tinydrm_flush_end(fb->dev, ret, ret ? 0 : len);
+	if (ret)
+		dev_err_once(fb->dev->dev, "Failed to update display %d\n", ret);
+
+	drm_dev_exit(idx);
+}
+
+/**
+ * tinydrm_mipi_dbi_fb_dirty - Flush a rectangle to a MIPI DBI display
+ * @mbox: Mailbox, its statistics are updated
+ * @fb: Framebuffer
+ * @rect: Rectangle
+ *
+ * Same as mipi_dbi_fb_dirty() which isn't exported. Used as the mailbox
+ * flush function. RGB565 in the byte order of the bus is sent straight from
+ * the framebuffer when the rectangle spans whole lines.
+ */
+void tinydrm_mipi_dbi_fb_dirty(struct tinydrm_mailbox *mbox,
+			       struct drm_framebuffer *fb, struct drm_rect *rect)
+{
+	__tinydrm_mipi_dbi_fb_dirty(mbox, fb, rect, false);
+}
+EXPORT_SYMBOL(tinydrm_mipi_dbi_fb_dirty);
+
+/**
+ * tinydrm_mipi_dbi_fb_dirty_rgb444 - Flush a rectangle as 12-bit pixels
+ * @mbox: Mailbox, its statistics are updated
+ * @fb: Framebuffer
+ * @rect: Rectangle
+ *
+ * Like tinydrm_mipi_dbi_fb_dirty(), but packs the pixels as RGB444 which
+ * sends a quarter fewer bytes. The controller pixel format has to be set to
+ * 12 bits per pixel.
+ */
+void tinydrm_mipi_dbi_fb_dirty_rgb444(struct tinydrm_mailbox *mbox,
+				      struct drm_framebuffer *fb,
+				      struct drm_rect *rect)
+{
+	__tinydrm_mipi_dbi_fb_dirty(mbox, fb, rect, true);
+}
+EXPORT_SYMBOL(tinydrm_mipi_dbi_fb_dirty_rgb444);
+
+/**
+ * tinydrm_mipi_dbi_enable_flush - Flush the framebuffer and turn on backlight
+ * @mbox: Mailbox
+ * @crtc_state: CRTC state
+ * @plane_state: Plane state
+ *
+ * Like mipi_dbi_enable_flush(), but flushes through the mailbox worker.
+ */
+void tinydrm_mipi_dbi_enable_flush(struct tinydrm_mailbox *mbox,
+				   struct drm_crtc_state *crtc_state,
+				   struct drm_plane_state *plane_state)
+{
+	struct drm_framebuffer *fb = plane_state->fb;
+	struct mipi_dbi_dev *dbidev = drm_to_mipi_dbi_dev(fb->dev);
+
+	dbidev->enabled = true;
+	tinydrm_mailbox_flush_all(mbox, plane_state);
+	backlight_enable(dbidev->backlight);
+}
+EXPORT_SYMBOL(tinydrm_mipi_dbi_enable_flush);
+
+/**
+ * tinydrm_mipi_dbi_enable_keep - Turn on backlight without flushing
+ * @dbidev: MIPI DBI device
+ *
+ * Used on the first enable of a panel that was set up by the bootloader. Its
+ * splash stays on the display until the first update.
+ */
+void tinydrm_mipi_dbi_enable_keep(struct mipi_dbi_dev *dbidev)
+{
+	dbidev->enabled = true;
+	backlight_enable(dbidev->backlight);
+}
+EXPORT_SYMBOL(tinydrm_mipi_dbi_enable_keep);
+
+/**
+ * tinydrm_mipi_dbi_line_buf_init - Allocate the conversion line buffer
+ * @mbox: Mailbox
+ * @drm: DRM device, with its framebuffer size limits set
+ *
+ * Allocates &tinydrm_mailbox.line_buf for the widest framebuffer, so the
+ * conversions in tinydrm_mipi_dbi_fb_dirty() don't allocate on every flush.
+ * Call it after tinydrm_rotation_init() which can widen the limits.
+ *
+ * Returns:
+ * Zero on success, negative error code on failure.
+ */
+int tinydrm_mipi_dbi_line_buf_init(struct tinydrm_mailbox *mbox,
+				   struct drm_device *drm)
+{
+	unsigned int width = drm->mode_config.max_width;
+	size_t size;
+
+	/* A YUV line with its lead pixel, and the RGB565 pixels for RGB444 */
+	size = (width + 2) * 4 + width * sizeof(u16);
+	mbox->line_buf = devm_kmalloc(drm->dev, size, GFP_KERNEL);
+	if (!mbox->line_buf)
+		return -ENOMEM;
+
+	return 0;
+}
+EXPORT_SYMBOL(tinydrm_mipi_dbi_line_buf_init);
+
+#define MIPI_DBI_MY	BIT(7)
+#define MIPI_DBI_MX	BIT(6)
+#define MIPI_DBI_MV	BIT(5)
+
+/**
+ * tinydrm_mipi_dbi_addr_mode - Address mode for a plane rotation
+ * @addr_modes: Address mode of the panel for 0, 90, 180 and 270 degrees
+ * @degrees: Panel rotation from the rotation property
+ * @rotation: Plane rotation
+ *
+ * Reflection is applied to the framebuffer before it's rotated, see
+ * drm_rect_rotate(). MX and MY mirror controller memory, so with the row
+ * and column exchange they mirror the other framebuffer axis.
+ *
+ * Returns:
+ * Value for MIPI_DCS_SET_ADDRESS_MODE.
+ */
+u8 tinydrm_mipi_dbi_addr_mode(const u8 *addr_modes, unsigned int degrees,
+			      unsigned int rotation)
+{
+	u8 addr_mode = addr_modes[tinydrm_rotation_index(degrees, rotation)];
+	bool mv = addr_mode & MIPI_DBI_MV;
+
+	if (rotation & DRM_MODE_REFLECT_X)
+		addr_mode ^= mv ? MIPI_DBI_MY : MIPI_DBI_MX;
+	if (rotation & DRM_MODE_REFLECT_Y)
+		addr_mode ^= mv ? MIPI_DBI_MX : MIPI_DBI_MY;
+
+	return addr_mode;
+}
+EXPORT_SYMBOL(tinydrm_mipi_dbi_addr_mode);
+
+/**
+ * tinydrm_mipi_dbi_frame_done - Send the page flip events of a flushed frame
+ * @dbidev: MIPI DBI device
+ * @mbox: Mailbox, the frame is accounted in its statistics
+ * @events: Page flip events of the frame
+ * @posted: Time the frame was posted, zero if it was never flushed
+ *
+ * Used from &tinydrm_mailbox.frame_done. The MIPI DBI flush functions return
+ * when the pixels have left the bus, so the client can reuse its buffer as
+ * soon as the events are out.
+ */
+void tinydrm_mipi_dbi_frame_done(struct mipi_dbi_dev *dbidev,
+				 struct tinydrm_mailbox *mbox,
+				 struct list_head *events, ktime_t posted)
+{
+	struct drm_crtc *crtc = &dbidev->pipe.crtc;
+	struct drm_pending_vblank_event *e, *tmp;
+	unsigned long flags;
+
+	if (posted)
+		tinydrm_stats_frame(&mbox->stats, posted);
+
+	spin_lock_irqsave(&dbidev->drm.event_lock, flags);
+	list_for_each_entry_safe(e, tmp, events, base.link) {
+		list_del(&e->base.link);
+		drm_crtc_send_vblank_event(crtc, e);
+	}
+	spin_unlock_irqrestore(&dbidev->drm.event_lock, flags);
+}
+EXPORT_SYMBOL(tinydrm_mipi_dbi_frame_done);
+
+/**
+ * tinydrm_mipi_dbi_pipe_update - Display pipe update helper
+ * @pipe: Simple display pipe
+ * @old_state: Old plane state
+ * @mbox: Mailbox
+ *
+ * Like mipi_dbi_pipe_update(), but flushes the rectangles chosen by
+ * tinydrm_damage_plan() instead of the merged damage, and does it from the
+ * mailbox worker so the commit doesn't wait for the bus. The page flip event
+ * is sent when the frame has been flushed, see tinydrm_mipi_dbi_frame_done().
+ */
+void tinydrm_mipi_dbi_pipe_update(struct drm_simple_display_pipe *pipe,
+				  struct drm_plane_state *old_state,
+				  struct tinydrm_mailbox *mbox)
+{
+	struct drm_crtc *crtc = &pipe->crtc;
+
+	tinydrm_mailbox_update(mbox, old_state, pipe->plane.state);
+
+	/* Display is off, DRM core handles this in Linux 5.7 */
+	if (crtc->state->event) {
+		spin_lock_irq(&crtc->dev->event_lock);
+		drm_crtc_send_vblank_event(crtc, crtc->state->event);
+		spin_unlock_irq(&crtc->dev->event_lock);
+		crtc->state->event = NULL;
+	}
+}
+EXPORT_SYMBOL(tinydrm_mipi_dbi_pipe_update);
+
+/*
+ * Pixel conversion
+ *
+ * The SPI controllers on the Raspberry Pi can't do 16-bit words so the pixels
+ * have to be byte swapped on the way. The conversion and the swap are done in
+ * one pass, with NEON when the CPU has it.
+ */
+
+static void tinydrm_swab16_line_generic(u16 *dst, const u16 *src,
+					unsigned int pixels)
+{
+	unsigned int x;
+
+	for (x = 0; x < pixels; x++)
+		dst[x] = swab16(src[x]);
+}
+
+static void tinydrm_xrgb8888_to_rgb565_line_generic(u16 *dst, const u32 *src,
+						    unsigned int pixels, bool swap)
+{
+	unsigned int x;
+	u16 val16;
+
+	for (x = 0; x < pixels; x++) {
+		val16 = ((src[x] & 0x00F80000) >> 8) |
+			((src[x] & 0x0000FC00) >> 5) |
+			((src[x] & 0x000000F8) >> 3);
+		if (swap)
+			dst[x] = swab16(val16);
+		else
+			dst[x] = val16;
+	}
+}
+
+static u8 tinydrm_yuv_clamp(int val)
+{
+	return clamp((val + 32) >> 6, 0, 255);
+}
+
+/*
+ * Chroma of pixel x is at @uv + x / 2 * @uvstep with V half a step after U.
+ * The arithmetic is the same as the NEON version, which saturates the 16-bit
+ * sums, but that only happens for values that clamp to 255 anyway.
+ */
+static void tinydrm_yuv_to_rgb565_line_generic(u16 *dst, const u8 *y,
+					       unsigned int ystep, const u8 *uv,
+					       unsigned int uvstep,
+					       unsigned int pixels,
+					       const struct tinydrm_yuv *yuv,
+					       bool swap)
+{
+	const s16 *coef = yuv->coef;
+	unsigned int x;
+	u16 val16;
+
+	for (x = 0; x < pixels; x++) {
+		const u8 *c = uv + x / 2 * uvstep;
+		int luma = (y[x * ystep] - yuv->y_offset) * coef[0];
+		int u = c[0] - 128;
+		int v = c[uvstep / 2] - 128;
+		u8 r = tinydrm_yuv_clamp(luma + coef[1] * v);
+		u8 g = tinydrm_yuv_clamp(luma - coef[2] * u - coef[3] * v);
+		u8 b = tinydrm_yuv_clamp(luma + coef[4] * u);
+
+		val16 = (r >> 3) << 11 | (g >> 2) << 5 | b >> 3;
+		if (swap)
+			dst[x] = swab16(val16);
+		else
+			dst[x] = val16;
+	}
+}
+
+#if IS_ENABLED(CONFIG_KERNEL_MODE_NEON)
+
+/*
+ * The NEON versions do 8 pixels per iteration and leave the rest to the
+ * generic versions.
+ *
+ * XRGB8888 is loaded de-interleaved into B, G, R and X byte lanes and the two
+ * RGB565 bytes are built with shift and insert:
+ *   high = R[7:3] G[7:5]
+ *   low  = G[4:2] B[7:3]
+ * The bytes are stored interleaved in the wanted order, so the swap is free.
+ *
+ * YUV does 16 pixels per iteration. Luma is split in even and odd pixels so
+ * each lane shares its chroma, the channels are computed in 16-bit lanes and
+ * narrowed with a rounding, saturating shift. For YUYV @uv is NULL.
+ */
+#ifdef CONFIG_ARM64
+
+static void tinydrm_swab16_neon(u16 *dst, const u16 *src, unsigned int blocks)
+{
+	asm volatile(
+		"1:	ld1	{v0.16b}, [%[src]], #16\n"
+		"	rev16	v0.16b, v0.16b\n"
+		"	st1	{v0.16b}, [%[dst]], #16\n"
+		"	subs	%w[n], %w[n], #1\n"
+		"	b.ne	1b\n"
+		: [src] "+r" (src), [dst] "+r" (dst), [n] "+r" (blocks)
+		:
+		: "v0", "cc", "memory");
+}
+
+static void tinydrm_xrgb8888_to_rgb565_neon(u16 *dst, const u32 *src,
+					    unsigned int blocks, bool swap)
+{
+	if (swap)
+		asm volatile(
+			"1:	ld4	{v0.8b, v1.8b, v2.8b, v3.8b}, [%[src]], #32\n"
+			"	shl	v4.8b, v1.8b, #3\n"
+			"	sri	v2.8b, v1.8b, #5\n"
+			"	sri	v4.8b, v0.8b, #3\n"
+			"	mov	v3.8b, v4.8b\n"
+			"	st2	{v2.8b, v3.8b}, [%[dst]], #16\n"
+			"	subs	%w[n], %w[n], #1\n"
+			"	b.ne	1b\n"
+			: [src] "+r" (src), [dst] "+r" (dst), [n] "+r" (blocks)
+			:
+			: "v0", "v1", "v2", "v3", "v4", "cc", "memory");
+	else
+		asm volatile(
+			"1:	ld4	{v0.8b, v1.8b, v2.8b, v3.8b}, [%[src]], #32\n"
+			"	shl	v4.8b, v1.8b, #3\n"
+			"	sri	v2.8b, v1.8b, #5\n"
+			"	sri	v4.8b, v0.8b, #3\n"
+			"	mov	v5.8b, v2.8b\n"
+			"	st2	{v4.8b, v5.8b}, [%[dst]], #16\n"
+			"	subs	%w[n], %w[n], #1\n"
+			"	b.ne	1b\n"
+			: [src] "+r" (src), [dst] "+r" (dst), [n] "+r" (blocks)
+			:
+			: "v0", "v1", "v2", "v3", "v4", "v5", "cc", "memory");
+}
+
+static void tinydrm_yuv_to_rgb565_neon(u16 *dst, const u8 *y, const u8 *uv,
+				       unsigned int blocks,
+				       const struct tinydrm_yuv *yuv, bool swap)
+{
+	unsigned int y_offset = yuv->y_offset, do_swap = swap;
+
+	asm volatile(
+		"	ld1	{v6.8h}, [%[coef]]\n"
+		"	dup	v4.8b, %w[yoff]\n"
+		"	movi	v5.8b, #128\n"
+		"1:	cbnz	%[uv], 2f\n"
+		"	ld4	{v0.8b, v1.8b, v2.8b, v3.8b}, [%[y]], #32\n"
+		"	mov	v7.8b, v1.8b\n"
+		"	mov	v1.8b, v2.8b\n"
+		"	mov	v2.8b, v7.8b\n"
+		"	b	3f\n"
+		"2:	ld2	{v0.8b, v1.8b}, [%[y]], #16\n"
+		"	ld2	{v2.8b, v3.8b}, [%[uv]], #16\n"
+		"3:	usubl	v16.8h, v0.8b, v4.8b\n"
+		"	usubl	v17.8h, v1.8b, v4.8b\n"
+		"	usubl	v18.8h, v2.8b, v5.8b\n"
+		"	usubl	v19.8h, v3.8b, v5.8b\n"
+		"	mul	v16.8h, v16.8h, v6.h[0]\n"
+		"	mul	v17.8h, v17.8h, v6.h[0]\n"
+		"	mul	v20.8h, v19.8h, v6.h[1]\n"
+		"	mul	v21.8h, v18.8h, v6.h[2]\n"
+		"	mla	v21.8h, v19.8h, v6.h[3]\n"
+		"	mul	v22.8h, v18.8h, v6.h[4]\n"
+		"	sqadd	v23.8h, v16.8h, v20.8h\n"
+		"	sqrshrun v0.8b, v23.8h, #6\n"
+		"	sqadd	v23.8h, v17.8h, v20.8h\n"
+		"	sqrshrun v1.8b, v23.8h, #6\n"
+		"	sqsub	v23.8h, v16.8h, v21.8h\n"
+		"	sqrshrun v2.8b, v23.8h, #6\n"
+		"	sqsub	v23.8h, v17.8h, v21.8h\n"
+		"	sqrshrun v3.8b, v23.8h, #6\n"
+		"	sqadd	v23.8h, v16.8h, v22.8h\n"
+		"	sqrshrun v24.8b, v23.8h, #6\n"
+		"	sqadd	v23.8h, v17.8h, v22.8h\n"
+		"	sqrshrun v25.8b, v23.8h, #6\n"
+		"	zip1	v0.16b, v0.16b, v1.16b\n"
+		"	zip1	v1.16b, v2.16b, v3.16b\n"
+		"	zip1	v2.16b, v24.16b, v25.16b\n"
+		"	sri	v0.16b, v1.16b, #5\n"
+		"	shl	v1.16b, v1.16b, #3\n"
+		"	sri	v1.16b, v2.16b, #3\n"
+		"	cbz	%w[swap], 4f\n"
+		"	st2	{v0.16b, v1.16b}, [%[dst]], #32\n"
+		"	b	5f\n"
+		"4:	mov	v26.16b, v1.16b\n"
+		"	mov	v27.16b, v0.16b\n"
+		"	st2	{v26.16b, v27.16b}, [%[dst]], #32\n"
+		"5:	subs	%w[n], %w[n], #1\n"
+		"	b.ne	1b\n"
+		: [y] "+r" (y), [uv] "+r" (uv), [dst] "+r" (dst), [n] "+r" (blocks)
+		: [coef] "r" (yuv->coef), [yoff] "r" (y_offset), [swap] "r" (do_swap)
+		: "v0", "v1", "v2", "v3", "v4", "v5", "v6", "v7", "v16", "v17",
+		  "v18", "v19", "v20", "v21", "v22", "v23", "v24", "v25", "v26",
+		  "v27", "cc", "memory");
+}
+
+static bool tinydrm_have_neon(void)
+{
+	return system_supports_fpsimd();
+}
+
+#else /* CONFIG_ARM */
+
+/* Built with NEON enabled in tinydrm-neon-arm.c */
+static void tinydrm_swab16_neon(u16 *dst, const u16 *src, unsigned int blocks)
+{
+	tinydrm_swab16_neon_arm(dst, src, blocks);
+}
+
+static void tinydrm_xrgb8888_to_rgb565_neon(u16 *dst, const u32 *src,
+					    unsigned int blocks, bool swap)
+{
+	tinydrm_xrgb8888_to_rgb565_neon_arm(dst, src, blocks, swap);
+}
+
+static void tinydrm_yuv_to_rgb565_neon(u16 *dst, const u8 *y, const u8 *uv,
+				       unsigned int blocks,
+				       const struct tinydrm_yuv *yuv, bool swap)
+{
+	tinydrm_yuv_to_rgb565_neon_arm(dst, y, uv, blocks, yuv->coef,
+				       yuv->y_offset, swap);
+}
+
+static bool tinydrm_have_neon(void)
+{
+	return cpu_has_neon();
+}
+
+#endif
+
+static bool tinydrm_use_neon;
+
+static bool tinydrm_neon_begin(unsigned int pixels)
+{
+	if (!tinydrm_use_neon || pixels < 8 || !may_use_simd())
+		return false;
+
+	kernel_neon_begin();
+
+	return true;
+}
+
+static void tinydrm_neon_end(void)
+{
+	kernel_neon_end();
+}
+
+#else
+
+static bool tinydrm_neon_begin(unsigned int pixels)
+{
+	return false;
+}
+
+static void tinydrm_neon_end(void)
+{
+}
+
+static void tinydrm_swab16_neon(u16 *dst, const u16 *src, unsigned int blocks)
+{
+}
+
+static void tinydrm_xrgb8888_to_rgb565_neon(u16 *dst, const u32 *src,
+					    unsigned int blocks, bool swap)
+{
+}
+
+static void tinydrm_yuv_to_rgb565_neon(u16 *dst, const u8 *y, const u8 *uv,
+				       unsigned int blocks,
+				       const struct tinydrm_yuv *yuv, bool swap)
+{
+}
+
+#endif
+
+/**
+ * tinydrm_rgb565_swap - Whether RGB565 pixels need a byte swap on the way
+ * @format: DRM_FORMAT_RGB565, optionally with DRM_FORMAT_BIG_ENDIAN
+ * @swap_bytes: The bus sends the pixels as bytes and needs them big endian,
+ *              see &mipi_dbi.swap_bytes
+ *
+ * Big endian RGB565 is already in wire order when the bus sends bytes, so
+ * userspace that renders in that order saves the swap pass.
+ */
+bool tinydrm_rgb565_swap(u32 format, bool swap_bytes)
+{
+	return !!(format & DRM_FORMAT_BIG_ENDIAN) != swap_bytes;
+}
+EXPORT_SYMBOL(tinydrm_rgb565_swap);
+
+/**
+ * tinydrm_swab16_line - Swap bytes of RGB565 pixels
+ * @dst: Destination
+ * @src: Source
+ * @pixels: Number of pixels
+ */
+void tinydrm_swab16_line(u16 *dst, const u16 *src, unsigned int pixels)
+{
+	unsigned int done = 0;
+
+	if (tinydrm_neon_begin(pixels)) {
+		done = round_down(pixels, 8);
+		tinydrm_swab16_neon(dst, src, done / 8);
+		tinydrm_neon_end();
+	}
+
+	tinydrm_swab16_line_generic(dst + done, src + done, pixels - done);
+}
+EXPORT_SYMBOL(tinydrm_swab16_line);
+
+/**
+ * tinydrm_c8_to_rgb565_line - Expand indexed pixels to RGB565
+ * @dst: Destination
+ * @src: Source
+ * @pixels: Number of pixels
+ * @palette: RGB565 value of each index
+ * @swap: Swap bytes
+ */
+void tinydrm_c8_to_rgb565_line(u16 *dst, const u8 *src, unsigned int pixels,
+			       const u16 *palette, bool swap)
+{
+	unsigned int x;
+
+	if (swap) {
+		for (x = 0; x < pixels; x++)
+			dst[x] = swab16(palette[src[x]]);
+	} else {
+		for (x = 0; x < pixels; x++)
+			dst[x] = palette[src[x]];
+	}
+}
+EXPORT_SYMBOL(tinydrm_c8_to_rgb565_line);
+
+/**
+ * tinydrm_xrgb8888_to_rgb565_line - Convert XRGB8888 pixels to RGB565
+ * @dst: Destination
+ * @src: Source
+ * @pixels: Number of pixels
+ * @swap: Swap bytes
+ */
+void tinydrm_xrgb8888_to_rgb565_line(u16 *dst, const u32 *src,
+				     unsigned int pixels, bool swap)
+{
+	unsigned int done = 0;
+
+	if (tinydrm_neon_begin(pixels)) {
+		done = round_down(pixels, 8);
+		tinydrm_xrgb8888_to_rgb565_neon(dst, src, done / 8, swap);
+		tinydrm_neon_end();
+	}
+
+	tinydrm_xrgb8888_to_rgb565_line_generic(dst + done, src + done,
+						pixels - done, swap);
+}
+EXPORT_SYMBOL(tinydrm_xrgb8888_to_rgb565_line);
+
+/**
+ * tinydrm_yuyv_to_rgb565_line - Convert YUYV pixels to RGB565
+ * @dst: Destination
+ * @src: Source, starting on an even pixel
+ * @pixels: Number of pixels
+ * @yuv: Conversion, see &tinydrm_mailbox.flush_yuv
+ * @swap: Swap bytes
+ */
+void tinydrm_yuyv_to_rgb565_line(u16 *dst, const u8 *src, unsigned int pixels,
+				 const struct tinydrm_yuv *yuv, bool swap)
+{
+	unsigned int done = 0;
+
+	if (pixels >= 16 && tinydrm_neon_begin(pixels)) {
+		done = round_down(pixels, 16);
+		tinydrm_yuv_to_rgb565_neon(dst, src, NULL, done / 16, yuv, swap);
+		tinydrm_neon_end();
+	}
+
+	src += done * 2;
+	tinydrm_yuv_to_rgb565_line_generic(dst + done, src, 2, src + 1, 4,
+					   pixels - done, yuv, swap);
+}
+EXPORT_SYMBOL(tinydrm_yuyv_to_rgb565_line);
+
+/**
+ * tinydrm_nv12_to_rgb565_line - Convert NV12 pixels to RGB565
+ * @dst: Destination
+ * @y: Luma, starting on an even pixel
+ * @uv: Interleaved chroma of the line
+ * @pixels: Number of pixels
+ * @yuv: Conversion, see &tinydrm_mailbox.flush_yuv
+ * @swap: Swap bytes
+ */
+void tinydrm_nv12_to_rgb565_line(u16 *dst, const u8 *y, const u8 *uv,
+				 unsigned int pixels,
+				 const struct tinydrm_yuv *yuv, bool swap)
+{
+	unsigned int done = 0;
+
+	if (pixels >= 16 && tinydrm_neon_begin(pixels)) {
+		done = round_down(pixels, 16);
+		tinydrm_yuv_to_rgb565_neon(dst, y, uv, done / 16, yuv, swap);
+		tinydrm_neon_end();
+	}
+
+	tinydrm_yuv_to_rgb565_line_generic(dst + done, y + done, 1, uv + done, 2,
+					   pixels - done, yuv, swap);
+}
+EXPORT_SYMBOL(tinydrm_nv12_to_rgb565_line);
+
+/**
+ * tinydrm_convert_impl - Name of the pixel conversion implementation in use
+ */
+const char *tinydrm_convert_impl(void)
+{
+#if IS_ENABLED(CONFIG_KERNEL_MODE_NEON)
+	if (tinydrm_use_neon)
+		return "neon";
+#endif
+	return "generic";
+}
+EXPORT_SYMBOL(tinydrm_convert_impl);
+
+static int __init tinydrm_helpers_init(void)
+{
+#if IS_ENABLED(CONFIG_KERNEL_MODE_NEON)
+	/* Checked against the generic versions by the KUnit tests */
+	tinydrm_use_neon = tinydrm_have_neon();
+#endif
+	pr_debug("tinydrm: Using %s pixel conversion\n", tinydrm_convert_impl());
+
+	return 0;
+}
+module_init(tinydrm_helpers_init);
+
+static void __exit tinydrm_helpers_exit(void)
+{
+}
+module_exit(tinydrm_helpers_exit);
+
+MODULE_DESCRIPTION("Helpers shared by the tiny DRM drivers");
+MODULE_AUTHOR("Noralf Trønnes");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,378 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * KUnit tests for the tinydrm pixel conversion helpers
+ *
+ * Copyright 2020 Noralf Trønnes
+ */
+
+#include <kunit/test.h>
+#include <linux/atomic.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/sched.h>
+#include <linux/string.h>
+#include <linux/swab.h>
+#include <trace/events/kmem.h>
+
+#include <drm/drm_color_mgmt.h>
+#include <drm/drm_fourcc.h>
+#include <drm/drm_framebuffer.h>
+#include <drm/drm_gem_cma_helper.h>
+#include <drm/drm_rect.h>
+
+#include "tinydrm-helpers.h"
+
+/*
+ * Long enough for the NEON versions to do a block, the short line goes
+ * through the generic versions only.
+ */
+#define TINYDRM_TEST_PIXELS	32
+#define TINYDRM_TEST_SHORT	2
+
+/*
+ * The conversion has 6 fractional bits and the YUV values are rounded, so the
+ * result can be off by one step of RGB565. 75% is 191 which is right below
+ * a step in both 5 and 6 bits.
+ */
+#define TINYDRM_TEST_TOLERANCE	1
+
+/* Odd, so the NEON versions leave a tail to the generic ones */
+#define TINYDRM_TEST_LINE	67
+
+/* YUYV framebuffer flushed 2x upscaled, a quarter of a 320x240 panel */
+#define TINYDRM_TEST_FB_WIDTH	80
+#define TINYDRM_TEST_FB_HEIGHT	60
+#define TINYDRM_TEST_FLUSHES	16
+
+struct tinydrm_yuv_vector {
+	const char *name;
+	u8 y, u, v;
+	u8 r, g, b;
+};
+
+struct tinydrm_yuv_case {
+	enum drm_color_encoding encoding;
+	enum drm_color_range range;
+	struct tinydrm_yuv_vector vectors[8];
+};
+
+/* Black, white and the 75% colour bars, YUV rounded from the exact values */
+static const struct tinydrm_yuv_case tinydrm_yuv_cases[] = {
+	{
+		DRM_COLOR_YCBCR_BT601, DRM_COLOR_YCBCR_LIMITED_RANGE, {
+			{ "black",    16, 128, 128,   0,   0,   0 },
+			{ "white",   235, 128, 128, 255, 255, 255 },
+			{ "yellow",  161,  44, 142, 191, 191,   0 },
+			{ "cyan",    131, 156,  44,   0, 191, 191 },
+			{ "green",   112,  72,  58,   0, 191,   0 },
+			{ "magenta",  84, 184, 198, 191,   0, 191 },
+			{ "red",      65, 100, 212, 191,   0,   0 },
+			{ "blue",     35, 212, 114,   0,   0, 191 },
+		},
+	}, {
+		DRM_COLOR_YCBCR_BT601, DRM_COLOR_YCBCR_FULL_RANGE, {
+			{ "black",     0, 128, 128,   0,   0,   0 },
+			{ "white",   255, 128, 128, 255, 255, 255 },
+			{ "yellow",  169,  32, 144, 191, 191,   0 },
+			{ "cyan",    134, 160,  32,   0, 191, 191 },
+			{ "green",   112,  65,  48,   0, 191,   0 },
+			{ "magenta",  79, 191, 208, 191,   0, 191 },
+			{ "red",      57,  96, 224, 191,   0,   0 },
+			{ "blue",     22, 224, 112,   0,   0, 191 },
+		},
+	}, {
+		DRM_COLOR_YCBCR_BT709, DRM_COLOR_YCBCR_LIMITED_RANGE, {
+			{ "black",    16, 128, 128,   0,   0,   0 },
+			{ "white",   235, 128, 128, 255, 255, 255 },
+			{ "yellow",  168,  44, 136, 191, 191,   0 },
+			{ "cyan",    145, 147,  44,   0, 191, 191 },
+			{ "green",   133,  63,  52,   0, 191,   0 },
+			{ "magenta",  63, 193, 204, 191,   0, 191 },
+			{ "red",      51, 109, 212, 191,   0,   0 },
+			{ "blue",     28, 212, 120,   0,   0, 191 },
+		},
+	}, {
+		DRM_COLOR_YCBCR_BT709, DRM_COLOR_YCBCR_FULL_RANGE, {
+			{ "black",     0, 128, 128,   0,   0,   0 },
+			{ "white",   255, 128, 128, 255, 255, 255 },
+			{ "yellow",  177,  32, 137, 191, 191,   0 },
+			{ "cyan",    150, 150,  32,   0, 191, 191 },
+			{ "green",   137,  54,  41,   0, 191,   0 },
+			{ "magenta",  54, 202, 215, 191,   0, 191 },
+			{ "red",      41, 106, 224, 191,   0,   0 },
+			{ "blue",     14, 224, 119,   0,   0, 191 },
+		},
+	},
+};
+
+static void tinydrm_test_rgb565(struct kunit *test,
+				const struct tinydrm_yuv_case *tc,
+				const struct tinydrm_yuv_vector *vec,
+				const char *format, const u16 *line,
+				unsigned int pixels, bool swap)
+{
+	const char *encoding = tc->encoding == DRM_COLOR_YCBCR_BT601 ?
+			       "BT.601" : "BT.709";
+	const char *range = tc->range == DRM_COLOR_YCBCR_LIMITED_RANGE ?
+			    "limited" : "full";
+	unsigned int x;
+
+	for (x = 0; x < pixels; x++) {
+		u16 val = swap ? swab16(line[x]) : line[x];
+		int r = val >> 11, g = (val >> 5) & 0x3f, b = val & 0x1f;
+
+		KUNIT_EXPECT_TRUE_MSG(test,
+				      abs(r - (vec->r >> 3)) <= TINYDRM_TEST_TOLERANCE &&
+				      abs(g - (vec->g >> 2)) <= TINYDRM_TEST_TOLERANCE &&
+				      abs(b - (vec->b >> 3)) <= TINYDRM_TEST_TOLERANCE,
+				      "%s %s %s %s, %u pixels: pixel %u is 0x%04x, want %u,%u,%u",
+				      format, encoding, range, vec->name, pixels, x,
+				      val, vec->r, vec->g, vec->b);
+	}
+}
+
+static void tinydrm_test_yuv_vector(struct kunit *test,
+				    const struct tinydrm_yuv_case *tc,
+				    const struct tinydrm_yuv_vector *vec,
+				    unsigned int pixels, bool swap)
+{
+	const struct tinydrm_yuv *yuv = tinydrm_yuv_get(tc->encoding, tc->range);
+	u8 yuyv[TINYDRM_TEST_PIXELS * 2], y[TINYDRM_TEST_PIXELS];
+	u8 uv[TINYDRM_TEST_PIXELS];
+	u16 line[TINYDRM_TEST_PIXELS];
+	unsigned int x;
+
+	for (x = 0; x < pixels; x += 2) {
+		yuyv[x * 2] = vec->y;
+		yuyv[x * 2 + 1] = vec->u;
+		yuyv[x * 2 + 2] = vec->y;
+		yuyv[x * 2 + 3] = vec->v;
+		y[x] = vec->y;
+		y[x + 1] = vec->y;
+		uv[x] = vec->u;
+		uv[x + 1] = vec->v;
+	}
+
+	tinydrm_yuyv_to_rgb565_line(line, yuyv, pixels, yuv, swap);
+	tinydrm_test_rgb565(test, tc, vec, "YUYV", line, pixels, swap);
+
+	tinydrm_nv12_to_rgb565_line(line, y, uv, pixels, yuv, swap);
+	tinydrm_test_rgb565(test, tc, vec, "NV12", line, pixels, swap);
+}
+
+static void tinydrm_test_yuv_to_rgb565(struct kunit *test)
+{
+	const struct tinydrm_yuv_case *tc;
+	unsigned int i, j;
+
+	for (i = 0; i < ARRAY_SIZE(tinydrm_yuv_cases); i++) {
+		tc = &tinydrm_yuv_cases[i];
+		for (j = 0; j < ARRAY_SIZE(tc->vectors); j++) {
+			tinydrm_test_yuv_vector(test, tc, &tc->vectors[j],
+						TINYDRM_TEST_SHORT, false);
+			tinydrm_test_yuv_vector(test, tc, &tc->vectors[j],
+						TINYDRM_TEST_PIXELS, false);
+			tinydrm_test_yuv_vector(test, tc, &tc->vectors[j],
+						TINYDRM_TEST_PIXELS, true);
+		}
+	}
+}
+
+/*
+ * Compare whole lines with the same line converted one pixel, or one pair of
+ * YUV pixels, at a time. That is below the NEON block size, so it's always the
+ * generic code.
+ */
+static void tinydrm_test_neon(struct kunit *test)
+{
+	static u32 xrgb8888[TINYDRM_TEST_LINE];
+	static u16 rgb565[TINYDRM_TEST_LINE];
+	static u16 expected[TINYDRM_TEST_LINE];
+	static u16 result[TINYDRM_TEST_LINE];
+	const struct tinydrm_yuv *yuv;
+	unsigned int i, x, swap;
+	u8 *src, *uv;
+
+	kunit_info(test, "Using %s pixel conversion\n", tinydrm_convert_impl());
+
+	for (i = 0; i < TINYDRM_TEST_LINE; i++) {
+		xrgb8888[i] = 0x9e3779b9 * (i + 1);
+		rgb565[i] = xrgb8888[i] >> 7;
+	}
+
+	for (swap = 0; swap < 2; swap++) {
+		for (x = 0; x < TINYDRM_TEST_LINE; x++)
+			tinydrm_xrgb8888_to_rgb565_line(expected + x,
+							xrgb8888 + x, 1, swap);
+		tinydrm_xrgb8888_to_rgb565_line(result, xrgb8888,
+						TINYDRM_TEST_LINE, swap);
+		KUNIT_EXPECT_EQ_MSG(test, memcmp(expected, result, sizeof(result)), 0,
+				    "XRGB8888 swap=%u", swap);
+	}
+
+	for (x = 0; x < TINYDRM_TEST_LINE; x++)
+		tinydrm_swab16_line(expected + x, rgb565 + x, 1);
+	tinydrm_swab16_line(result, rgb565, TINYDRM_TEST_LINE);
+	KUNIT_EXPECT_EQ_MSG(test, memcmp(expected, result, sizeof(result)), 0,
+			    "RGB565 swab");
+
+	/* YUYV and NV12 from the same bytes, every encoding and range */
+	src = (u8 *)xrgb8888;
+	uv = src + TINYDRM_TEST_LINE + 1;
+	for (i = 0; i < 8; i++) {
+		yuv = tinydrm_yuv_get(i / 4, i / 2 % 2);
+		swap = i % 2;
+
+		for (x = 0; x < TINYDRM_TEST_LINE; x += 2)
+			tinydrm_yuyv_to_rgb565_line(expected + x, src + x * 2,
+						    min(2U, TINYDRM_TEST_LINE - x),
+						    yuv, swap);
+		tinydrm_yuyv_to_rgb565_line(result, src, TINYDRM_TEST_LINE,
+					    yuv, swap);
+		KUNIT_EXPECT_EQ_MSG(test, memcmp(expected, result, sizeof(result)), 0,
+				    "YUYV encoding=%u range=%u swap=%u",
+				    i / 4, i / 2 % 2, swap);
+
+		for (x = 0; x < TINYDRM_TEST_LINE; x += 2)
+			tinydrm_nv12_to_rgb565_line(expected + x, src + x, uv + x,
+						    min(2U, TINYDRM_TEST_LINE - x),
+						    yuv, swap);
+		tinydrm_nv12_to_rgb565_line(result, src, uv, TINYDRM_TEST_LINE,
+					    yuv, swap);
+		KUNIT_EXPECT_EQ_MSG(test, memcmp(expected, result, sizeof(result)), 0,
+				    "NV12 encoding=%u range=%u swap=%u",
+				    i / 4, i / 2 % 2, swap);
+	}
+}
+
+struct tinydrm_test_allocs {
+	struct task_struct *task;
+	atomic_t count;
+};
+
+static void tinydrm_test_alloc(struct tinydrm_test_allocs *allocs)
+{
+	if (current == allocs->task)
+		atomic_inc(&allocs->count);
+}
+
+static void tinydrm_test_kmalloc(void *data, unsigned long call_site,
+				 const void *ptr, size_t bytes_req,
+				 size_t bytes_alloc, gfp_t gfp_flags)
+{
+	tinydrm_test_alloc(data);
+}
+
+static void tinydrm_test_kmalloc_node(void *data, unsigned long call_site,
+				      const void *ptr, size_t bytes_req,
+				      size_t bytes_alloc, gfp_t gfp_flags,
+				      int node)
+{
+	tinydrm_test_alloc(data);
+}
+
+static void tinydrm_test_flush(struct drm_framebuffer *fb, u16 *dst, void *line,
+			       const struct tinydrm_yuv *yuv, unsigned int i)
+{
+	struct drm_rect rect, clip;
+	int ret;
+
+	/* Full, partial and odd positioned damage like the worker flushes */
+	switch (i % 3) {
+	case 0:
+		drm_rect_init(&rect, 0, 0, fb->width * 2, fb->height * 2);
+		break;
+	case 1:
+		drm_rect_init(&rect, 10, 20, 64, 32);
+		break;
+	default:
+		drm_rect_init(&rect, 33, 7, 17, 41);
+		break;
+	}
+
+	drm_rect_init(&clip, rect.x1 / 2, rect.y1 / 2,
+		      DIV_ROUND_UP(rect.x2, 2) - rect.x1 / 2,
+		      DIV_ROUND_UP(rect.y2, 2) - rect.y1 / 2);
+	ret = tinydrm_yuv_buf_copy(dst, fb, &clip, yuv, i % 2, line);
+	WARN_ON(ret);
+	tinydrm_upscale(dst, &rect, 1, 1);
+}
+
+/*
+ * The flush path runs for every frame and must not allocate. Count the
+ * allocations this task does while converting and upscaling a YUYV
+ * framebuffer, which is the longest path through the helpers.
+ */
+static void tinydrm_test_flush_allocs(struct kunit *test)
+{
+	struct tinydrm_test_allocs allocs = { .task = current };
+	const struct tinydrm_yuv *yuv;
+	struct drm_gem_cma_object *cma_obj;
+	struct drm_framebuffer *fb;
+	unsigned int i;
+	void *line;
+	u16 *dst;
+	int ret;
+
+	cma_obj = kunit_kzalloc(test, sizeof(*cma_obj), GFP_KERNEL);
+	fb = kunit_kzalloc(test, sizeof(*fb), GFP_KERNEL);
+	dst = kunit_kzalloc(test, TINYDRM_TEST_FB_WIDTH * TINYDRM_TEST_FB_HEIGHT * 4 *
+			    sizeof(u16), GFP_KERNEL);
+	line = kunit_kzalloc(test, (TINYDRM_TEST_FB_WIDTH + 2) * 4, GFP_KERNEL);
+	KUNIT_ASSERT_TRUE(test, cma_obj && fb && dst && line);
+
+	cma_obj->vaddr = kunit_kzalloc(test, TINYDRM_TEST_FB_WIDTH * 2 *
+				       TINYDRM_TEST_FB_HEIGHT, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, cma_obj->vaddr);
+
+	fb->format = drm_format_info(DRM_FORMAT_YUYV);
+	fb->width = TINYDRM_TEST_FB_WIDTH;
+	fb->height = TINYDRM_TEST_FB_HEIGHT;
+	fb->pitches[0] = TINYDRM_TEST_FB_WIDTH * 2;
+	fb->obj[0] = &cma_obj->base;
+	memset(cma_obj->vaddr, 0x80, fb->pitches[0] * fb->height);
+
+	yuv = tinydrm_yuv_get(DRM_COLOR_YCBCR_BT601, DRM_COLOR_YCBCR_LIMITED_RANGE);
+
+	ret = register_trace_kmalloc(tinydrm_test_kmalloc, &allocs);
+	KUNIT_ASSERT_EQ(test, ret, 0);
+	ret = register_trace_kmem_cache_alloc(tinydrm_test_kmalloc, &allocs);
+	if (!ret)
+		ret = register_trace_kmalloc_node(tinydrm_test_kmalloc_node, &allocs);
+	if (!ret)
+		ret = register_trace_kmem_cache_alloc_node(tinydrm_test_kmalloc_node,
+							   &allocs);
+
+	if (!ret) {
+		for (i = 0; i < TINYDRM_TEST_FLUSHES; i++)
+			tinydrm_test_flush(fb, dst, line, yuv, i);
+	}
+
+	unregister_trace_kmem_cache_alloc_node(tinydrm_test_kmalloc_node, &allocs);
+	unregister_trace_kmalloc_node(tinydrm_test_kmalloc_node, &allocs);
+	unregister_trace_kmem_cache_alloc(tinydrm_test_kmalloc, &allocs);
+	unregister_trace_kmalloc(tinydrm_test_kmalloc, &allocs);
+	tracepoint_synchronize_unregister();
+
+	KUNIT_ASSERT_EQ(test, ret, 0);
+	KUNIT_EXPECT_EQ_MSG(test, atomic_read(&allocs.count), 0,
+			    "%u flushes allocated memory", TINYDRM_TEST_FLUSHES);
+}
+
+static struct kunit_case tinydrm_helpers_test_cases[] = {
+	KUNIT_CASE(tinydrm_test_yuv_to_rgb565),
+	KUNIT_CASE(tinydrm_test_neon),
+	KUNIT_CASE(tinydrm_test_flush_allocs),
+	{}
+};
+
+static struct kunit_suite tinydrm_helpers_test_suite = {
+	.name = "tinydrm-helpers",
+	.test_cases = tinydrm_helpers_test_cases,
+};
+
+kunit_test_suites(&tinydrm_helpers_test_suite);
+
+MODULE_DESCRIPTION("KUnit tests for the tinydrm helpers");
+MODULE_AUTHOR("Noralf Trønnes");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,261 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright 2020 Noralf Trønnes
+ */
+
+#ifndef __LINUX_TINYDRM_HELPERS_H
+#define __LINUX_TINYDRM_HELPERS_H
+
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+#include <linux/workqueue.h>
+
+#include <drm/drm_color_mgmt.h>
+#include <drm/drm_modeset_helper_vtables.h>
+#include <drm/drm_rect.h>
+
+struct dentry;
+struct drm_crtc;
+struct drm_crtc_state;
+struct drm_device;
+struct drm_property_blob;
+struct tinydrm_yuv;
+struct drm_framebuffer;
+struct drm_plane;
+struct drm_plane_state;
+struct drm_simple_display_pipe;
+struct mipi_dbi_dev;
+
+#define TINYDRM_DAMAGE_MAX_RECTS	8
+#define TINYDRM_PALETTE_SIZE		256
+
+enum tinydrm_damage_strategy {
+	TINYDRM_DAMAGE_BOUNDING_BOX,
+	TINYDRM_DAMAGE_MERGED,
+	TINYDRM_DAMAGE_SEPARATE,
+	TINYDRM_DAMAGE_NUM_STRATEGIES,
+};
+
+/**
+ * struct tinydrm_damage - Damage flush planner
+ * @setup_cost: Cost of flushing a rectangle in addition to its pixels,
+ *              expressed as the number of bytes that could have been
+ *              transferred in the same time
+ * @strategy: Strategy used by the last flush
+ * @count: Number of flushes per strategy
+ * @bytes_sent: Pixel bytes flushed
+ * @bytes_saved: Pixel bytes saved compared to flushing the bounding box
+ */
+struct tinydrm_damage {
+	unsigned int setup_cost;
+	enum tinydrm_damage_strategy strategy;
+	u64 count[TINYDRM_DAMAGE_NUM_STRATEGIES];
+	u64 bytes_sent;
+	u64 bytes_saved;
+};
+
+void tinydrm_damage_init(struct tinydrm_damage *damage, unsigned int setup_cost);
+unsigned int tinydrm_damage_plan(struct tinydrm_damage *damage,
+				 struct drm_plane_state *old_state,
+				 struct drm_plane_state *state, unsigned int cpp,
+				 struct drm_rect *rects, unsigned int max_rects);
+void tinydrm_damage_debugfs_init(struct tinydrm_damage *damage,
+				 struct dentry *root);
+
+#define TINYDRM_STATS_LATENCY_BUCKETS	128
+
+/**
+ * struct tinydrm_stats - Flush statistics
+ * @lock: Protects the counters, also taken from SPI completion callbacks
+ * @reset: Time of the last reset
+ * @frames: Number of frames flushed
+ * @dropped: Number of frames replaced by a newer one before being flushed
+ * @bytes: Pixel bytes sent
+ * @latency_us: Sum of frame latencies
+ * @convert_ns: Time spent converting pixels
+ * @bus_ns: Time the bus was busy sending pixels
+ * @latency: Frame latency histogram with 1 ms buckets, the last bucket also
+ *           counts the slower frames
+ *
+ * Frame latency is the time from a frame being posted to the mailbox until
+ * its last pixel has left the bus.
+ */
+struct tinydrm_stats {
+	spinlock_t lock;
+	ktime_t reset;
+	u64 frames;
+	u64 dropped;
+	u64 bytes;
+	u64 latency_us;
+	u64 convert_ns;
+	u64 bus_ns;
+	u32 latency[TINYDRM_STATS_LATENCY_BUCKETS];
+};
+
+void tinydrm_stats_frame(struct tinydrm_stats *stats, ktime_t posted);
+void tinydrm_stats_convert(struct tinydrm_stats *stats, u64 ns);
+void tinydrm_stats_bus(struct tinydrm_stats *stats, u64 ns, size_t bytes);
+
+/**
+ * struct tinydrm_mailbox - Latest-wins flush worker
+ * @work: Flush worker
+ * @lock: Protects @fb, @rects, @num_rects and the counters
+ * @fb: Newest framebuffer waiting to be flushed, holds a reference
+ * @src: Visible part of @fb in framebuffer pixels, from the plane source
+ * @display: Part of the display covered by @fb in its orientation, clipped to
+ *           the CRTC
+ * @rotation: Plane rotation of @fb
+ * @yuv: YUV to RGB conversion of @fb from the plane color encoding and range
+ * @scale_x: log2 of the horizontal upscaling of @fb
+ * @scale_y: log2 of the vertical upscaling of @fb
+ * @post_time: Time @fb was posted
+ * @rects: Damage accumulated since the last flush
+ * @num_rects: Number of rectangles in @rects
+ * @set_rotation: Optional, called from the worker with the plane rotation of
+ *                a framebuffer before its rectangles are flushed
+ * @frame_start: Optional, called from the worker once per frame before the
+ *               first of its rectangles is flushed, after @set_rotation
+ * @flush: Flushes one rectangle of a framebuffer to the display
+ * @x_offset: Column of the visible area in controller memory, used by
+ *            tinydrm_mipi_dbi_fb_dirty()
+ * @y_offset: Row of the visible area in controller memory
+ * @line_buf: Conversion line buffer used by tinydrm_mipi_dbi_fb_dirty(), see
+ *            tinydrm_mipi_dbi_line_buf_init()
+ * @palette: C8 palette from the CRTC gamma LUT as RGB565 in CPU order
+ * @palette_changed: @palette has changed since the worker took a copy
+ * @flush_palette: Palette used by the flush function, only touched by the
+ *                 worker
+ * @flush_yuv: YUV conversion of the framebuffer being flushed, pass it to
+ *             tinydrm_yuv_buf_copy()
+ * @flush_scale_x: log2 of the horizontal upscaling of the framebuffer being
+ *                 flushed. The rectangles passed to @flush are on the display,
+ *                 see tinydrm_upscale().
+ * @flush_scale_y: log2 of the vertical upscaling
+ * @flush_src: Visible part of the framebuffer being flushed. The rectangles
+ *             passed to @flush are relative to it, see
+ *             tinydrm_mailbox_fb_clip().
+ * @flush_display: Part of the display covered by the framebuffer being
+ *                 flushed, the rectangles passed to @flush are within it
+ * @events: Page flip events of the frames accumulated since the last flush
+ * @frame_done: Optional, called when the rectangles of a frame have been
+ *              flushed. Takes over the page flip events of the frame which
+ *              are linked through &drm_pending_event.link, and accounts the
+ *              frame in @stats using @posted when it has left the bus. @posted
+ *              is zero for frames that were never flushed. If not set, events
+ *              are left to the driver and the frame is accounted when the
+ *              flush function returns.
+ * @damage: Damage planner used for commits
+ * @plane_funcs: Plane helpers with upscaling added, see
+ *               tinydrm_mailbox_set_upscale()
+ * @posted: Number of frames posted
+ * @dropped: Number of frames replaced by a newer one before being flushed
+ * @stats: Flush statistics
+ *
+ * Commits don't wait for the bus. Each commit posts its framebuffer and
+ * damage, replacing any framebuffer still waiting, and the worker flushes
+ * the accumulated damage from the newest one.
+ */
+struct tinydrm_mailbox {
+	struct work_struct work;
+	spinlock_t lock;
+	struct drm_framebuffer *fb;
+	struct drm_rect src;
+	struct drm_rect display;
+	unsigned int rotation;
+	const struct tinydrm_yuv *yuv;
+	unsigned int scale_x;
+	unsigned int scale_y;
+	ktime_t post_time;
+	struct drm_rect rects[TINYDRM_DAMAGE_MAX_RECTS];
+	unsigned int num_rects;
+	void (*set_rotation)(struct tinydrm_mailbox *mbox, unsigned int rotation);
+	void (*frame_start)(struct tinydrm_mailbox *mbox);
+	void (*flush)(struct tinydrm_mailbox *mbox, struct drm_framebuffer *fb,
+		      struct drm_rect *rect);
+	unsigned int x_offset;
+	unsigned int y_offset;
+	void *line_buf;
+	u16 palette[TINYDRM_PALETTE_SIZE];
+	bool palette_changed;
+	u16 flush_palette[TINYDRM_PALETTE_SIZE];
+	const struct tinydrm_yuv *flush_yuv;
+	unsigned int flush_scale_x;
+	unsigned int flush_scale_y;
+	struct drm_rect flush_src;
+	struct drm_rect flush_display;
+	struct list_head events;
+	void (*frame_done)(struct tinydrm_mailbox *mbox, struct list_head *events,
+			   ktime_t posted);
+	struct tinydrm_damage *damage;
+	struct drm_plane_helper_funcs plane_funcs;
+	u64 posted;
+	u64 dropped;
+	struct tinydrm_stats stats;
+};
+
+void tinydrm_mailbox_init(struct tinydrm_mailbox *mbox,
+			  struct tinydrm_damage *damage,
+			  void (*flush)(struct tinydrm_mailbox *mbox,
+					struct drm_framebuffer *fb,
+					struct drm_rect *rect));
+void tinydrm_mailbox_update(struct tinydrm_mailbox *mbox,
+			    struct drm_plane_state *old_state,
+			    struct drm_plane_state *state);
+void tinydrm_mailbox_flush_all(struct tinydrm_mailbox *mbox,
+			       struct drm_plane_state *state);
+void tinydrm_mailbox_stop(struct tinydrm_mailbox *mbox);
+void tinydrm_mailbox_set_upscale(struct tinydrm_mailbox *mbox,
+				 struct drm_plane *plane);
+void tinydrm_mailbox_fb_clip(struct tinydrm_mailbox *mbox, struct drm_rect *clip,
+			     const struct drm_rect *rect);
+void tinydrm_mailbox_debugfs_init(struct tinydrm_mailbox *mbox,
+				  struct dentry *root);
+
+int tinydrm_rotation_init(struct drm_plane *plane);
+int tinydrm_palette_init(struct drm_crtc *crtc);
+int tinydrm_yuv_init(struct drm_plane *plane);
+unsigned int tinydrm_rotation_index(unsigned int degrees, unsigned int rotation);
+const struct tinydrm_yuv *tinydrm_yuv_get(enum drm_color_encoding encoding,
+					  enum drm_color_range range);
+
+bool tinydrm_rgb565_swap(u32 format, bool swap_bytes);
+void tinydrm_swab16_line(u16 *dst, const u16 *src, unsigned int pixels);
+void tinydrm_c8_to_rgb565_line(u16 *dst, const u8 *src, unsigned int pixels,
+			       const u16 *palette, bool swap);
+void tinydrm_xrgb8888_to_rgb565_line(u16 *dst, const u32 *src,
+				     unsigned int pixels, bool swap);
+void tinydrm_yuyv_to_rgb565_line(u16 *dst, const u8 *src, unsigned int pixels,
+				 const struct tinydrm_yuv *yuv, bool swap);
+void tinydrm_nv12_to_rgb565_line(u16 *dst, const u8 *y, const u8 *uv,
+				 unsigned int pixels,
+				 const struct tinydrm_yuv *yuv, bool swap);
+void tinydrm_upscale(u16 *buf, const struct drm_rect *rect,
+		     unsigned int scale_x, unsigned int scale_y);
+int tinydrm_yuv_buf_copy(u16 *dst, struct drm_framebuffer *fb,
+			 struct drm_rect *clip, const struct tinydrm_yuv *yuv,
+			 bool swap, void *line);
+const char *tinydrm_convert_impl(void);
+
+void tinydrm_mipi_dbi_fb_dirty(struct tinydrm_mailbox *mbox,
+			       struct drm_framebuffer *fb, struct drm_rect *rect);
+void tinydrm_mipi_dbi_fb_dirty_rgb444(struct tinydrm_mailbox *mbox,
+				      struct drm_framebuffer *fb,
+				      struct drm_rect *rect);
+void tinydrm_mipi_dbi_enable_flush(struct tinydrm_mailbox *mbox,
+				   struct drm_crtc_state *crtc_state,
+				   struct drm_plane_state *plane_state);
+void tinydrm_mipi_dbi_enable_keep(struct mipi_dbi_dev *dbidev);
+int tinydrm_mipi_dbi_line_buf_init(struct tinydrm_mailbox *mbox,
+				   struct drm_device *drm);
+u8 tinydrm_mipi_dbi_addr_mode(const u8 *addr_modes, unsigned int degrees,
+			      unsigned int rotation);
+void tinydrm_mipi_dbi_frame_done(struct mipi_dbi_dev *dbidev,
+				 struct tinydrm_mailbox *mbox,
+				 struct list_head *events, ktime_t posted);
+void tinydrm_mipi_dbi_pipe_update(struct drm_simple_display_pipe *pipe,
+				  struct drm_plane_state *old_state,
+				  struct tinydrm_mailbox *mbox);
+
+#endif /* __LINUX_TINYDRM_HELPERS_H */
@@ -0,0 +1,120 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * NEON pixel conversion for 32-bit ARM
+ *
+ * This file is built with NEON enabled and must only be called between
+ * kernel_neon_begin() and kernel_neon_end(), see
+ * Documentation/arm/kernel_mode_neon.rst. The arm64 versions and the
+ * description of the algorithms are in tinydrm-helpers-core.c.
+ *
+ * Copyright 2020 Noralf Trønnes
+ */
+
+#include <linux/types.h>
+
+#include "tinydrm-neon.h"
+
+void tinydrm_swab16_neon_arm(u16 *dst, const u16 *src, unsigned int blocks)
+{
+	asm volatile(
+		"1:	vld1.8	{d0-d1}, [%[src]]!\n"
+		"	vrev16.8 q0, q0\n"
+		"	vst1.8	{d0-d1}, [%[dst]]!\n"
+		"	subs	%[n], %[n], #1\n"
+		"	bne	1b\n"
+		: [src] "+r" (src), [dst] "+r" (dst), [n] "+r" (blocks)
+		:
+		: "d0", "d1", "cc", "memory");
+}
+
+void tinydrm_xrgb8888_to_rgb565_neon_arm(u16 *dst, const u32 *src,
+					 unsigned int blocks, bool swap)
+{
+	if (swap)
+		asm volatile(
+			"1:	vld4.8	{d0-d3}, [%[src]]!\n"
+			"	vshl.i8	d4, d1, #3\n"
+			"	vsri.8	d2, d1, #5\n"
+			"	vsri.8	d4, d0, #3\n"
+			"	vmov	d3, d4\n"
+			"	vst2.8	{d2-d3}, [%[dst]]!\n"
+			"	subs	%[n], %[n], #1\n"
+			"	bne	1b\n"
+			: [src] "+r" (src), [dst] "+r" (dst), [n] "+r" (blocks)
+			:
+			: "d0", "d1", "d2", "d3", "d4", "cc", "memory");
+	else
+		asm volatile(
+			"1:	vld4.8	{d0-d3}, [%[src]]!\n"
+			"	vshl.i8	d4, d1, #3\n"
+			"	vsri.8	d2, d1, #5\n"
+			"	vsri.8	d4, d0, #3\n"
+			"	vmov	d5, d2\n"
+			"	vst2.8	{d4-d5}, [%[dst]]!\n"
+			"	subs	%[n], %[n], #1\n"
+			"	bne	1b\n"
+			: [src] "+r" (src), [dst] "+r" (dst), [n] "+r" (blocks)
+			:
+			: "d0", "d1", "d2", "d3", "d4", "d5", "cc", "memory");
+}
+
+void tinydrm_yuv_to_rgb565_neon_arm(u16 *dst, const u8 *y, const u8 *uv,
+				    unsigned int blocks, const s16 *coef,
+				    unsigned int y_offset, bool swap)
+{
+	unsigned int do_swap = swap;
+
+	asm volatile(
+		"	vld1.16	{d6-d7}, [%[coef]]\n"
+		"	vdup.8	d4, %[yoff]\n"
+		"	vmov.i8	d5, #128\n"
+		"1:	cmp	%[uv], #0\n"
+		"	bne	2f\n"
+		"	vld4.8	{d0-d3}, [%[y]]!\n"
+		"	vswp	d1, d2\n"
+		"	b	3f\n"
+		"2:	vld2.8	{d0-d1}, [%[y]]!\n"
+		"	vld2.8	{d2-d3}, [%[uv]]!\n"
+		"3:	vsubl.u8 q8, d0, d4\n"
+		"	vsubl.u8 q9, d1, d4\n"
+		"	vsubl.u8 q10, d2, d5\n"
+		"	vsubl.u8 q11, d3, d5\n"
+		"	vmul.i16 q8, q8, d6[0]\n"
+		"	vmul.i16 q9, q9, d6[0]\n"
+		"	vmul.i16 q12, q11, d6[1]\n"
+		"	vmul.i16 q13, q10, d6[2]\n"
+		"	vmla.i16 q13, q11, d6[3]\n"
+		"	vmul.i16 q14, q10, d7[0]\n"
+		"	vqadd.s16 q15, q8, q12\n"
+		"	vqrshrun.s16 d0, q15, #6\n"
+		"	vqadd.s16 q15, q9, q12\n"
+		"	vqrshrun.s16 d1, q15, #6\n"
+		"	vqsub.s16 q15, q8, q13\n"
+		"	vqrshrun.s16 d2, q15, #6\n"
+		"	vqsub.s16 q15, q9, q13\n"
+		"	vqrshrun.s16 d3, q15, #6\n"
+		"	vqadd.s16 q15, q8, q14\n"
+		"	vqrshrun.s16 d24, q15, #6\n"
+		"	vqadd.s16 q15, q9, q14\n"
+		"	vqrshrun.s16 d25, q15, #6\n"
+		"	vzip.8	d0, d1\n"
+		"	vzip.8	d2, d3\n"
+		"	vzip.8	d24, d25\n"
+		"	vsri.8	q0, q1, #5\n"
+		"	vshl.i8	q1, q1, #3\n"
+		"	vsri.8	q1, q12, #3\n"
+		"	cmp	%[swap], #0\n"
+		"	beq	4f\n"
+		"	vst2.8	{d0-d3}, [%[dst]]!\n"
+		"	b	5f\n"
+		"4:	vmov	q13, q1\n"
+		"	vmov	q14, q0\n"
+		"	vst2.8	{d26-d29}, [%[dst]]!\n"
+		"5:	subs	%[n], %[n], #1\n"
+		"	bne	1b\n"
+		: [y] "+r" (y), [uv] "+r" (uv), [dst] "+r" (dst), [n] "+r" (blocks)
+		: [coef] "r" (coef), [yoff] "r" (y_offset), [swap] "r" (do_swap)
+		: "d0", "d1", "d2", "d3", "d4", "d5", "d6", "d7", "d16", "d17",
+		  "d18", "d19", "d20", "d21", "d22", "d23", "d24", "d25", "d26",
+		  "d27", "d28", "d29", "d30", "d31", "cc", "memory");
+}
@@ -0,0 +1,18 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright 2020 Noralf Trønnes
+ */
+
+#ifndef __LINUX_TINYDRM_NEON_H
+#define __LINUX_TINYDRM_NEON_H
+
+#include <linux/types.h>
+
+void tinydrm_swab16_neon_arm(u16 *dst, const u16 *src, unsigned int blocks);
+void tinydrm_xrgb8888_to_rgb565_neon_arm(u16 *dst, const u32 *src,
+					 unsigned int blocks, bool swap);
+void tinydrm_yuv_to_rgb565_neon_arm(u16 *dst, const u8 *y, const u8 *uv,
+				    unsigned int blocks, const s16 *coef,
+				    unsigned int y_offset, bool swap);
+
+#endif
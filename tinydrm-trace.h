@@ -0,0 +1,154 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright 2020 Noralf Trønnes
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM tinydrm
+
+#if !defined(__TINYDRM_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define __TINYDRM_TRACE_H
+
+#include <linux/device.h>
+#include <linux/tracepoint.h>
+
+#include <drm/drm_device.h>
+#include <drm/drm_rect.h>
+
+DECLARE_EVENT_CLASS(tinydrm_rect,
+	TP_PROTO(struct drm_device *drm, u32 fb_id, const struct drm_rect *rect),
+	TP_ARGS(drm, fb_id, rect),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(drm->dev))
+		__field(u32, fb_id)
+		__field(int, x1)
+		__field(int, y1)
+		__field(int, x2)
+		__field(int, y2)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(drm->dev));
+		__entry->fb_id = fb_id;
+		__entry->x1 = rect->x1;
+		__entry->y1 = rect->y1;
+		__entry->x2 = rect->x2;
+		__entry->y2 = rect->y2;
+	),
+	TP_printk("dev=%s fb=%u rect=%d,%d-%d,%d", __get_str(dev), __entry->fb_id,
+		  __entry->x1, __entry->y1, __entry->x2, __entry->y2)
+);
+
+/* A rectangle chosen by the damage planner */
+DEFINE_EVENT(tinydrm_rect, tinydrm_damage,
+	TP_PROTO(struct drm_device *drm, u32 fb_id, const struct drm_rect *rect),
+	TP_ARGS(drm, fb_id, rect)
+);
+
+DEFINE_EVENT(tinydrm_rect, tinydrm_flush_start,
+	TP_PROTO(struct drm_device *drm, u32 fb_id, const struct drm_rect *rect),
+	TP_ARGS(drm, fb_id, rect)
+);
+
+TRACE_EVENT(tinydrm_flush_end,
+	TP_PROTO(struct drm_device *drm, int ret, size_t bytes),
+	TP_ARGS(drm, ret, bytes),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(drm->dev))
+		__field(int, ret)
+		__field(size_t, bytes)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(drm->dev));
+		__entry->ret = ret;
+		__entry->bytes = bytes;
+	),
+	TP_printk("dev=%s ret=%d bytes=%zu", __get_str(dev), __entry->ret,
+		  __entry->bytes)
+);
+
+TRACE_EVENT(tinydrm_convert,
+	TP_PROTO(struct drm_device *drm, u32 format, unsigned int width,
+		 unsigned int height, u64 duration_ns),
+	TP_ARGS(drm, format, width, height, duration_ns),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(drm->dev))
+		__field(u32, format)
+		__field(unsigned int, width)
+		__field(unsigned int, height)
+		__field(u64, duration_ns)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(drm->dev));
+		__entry->format = format;
+		__entry->width = width;
+		__entry->height = height;
+		__entry->duration_ns = duration_ns;
+	),
+	TP_printk("dev=%s format=%08x size=%ux%u duration_ns=%llu", __get_str(dev),
+		  __entry->format, __entry->width, __entry->height,
+		  __entry->duration_ns)
+);
+
+TRACE_EVENT(tinydrm_spi_submit,
+	TP_PROTO(struct drm_device *drm, unsigned int buf, unsigned int msg,
+		 unsigned int len),
+	TP_ARGS(drm, buf, msg, len),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(drm->dev))
+		__field(unsigned int, buf)
+		__field(unsigned int, msg)
+		__field(unsigned int, len)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(drm->dev));
+		__entry->buf = buf;
+		__entry->msg = msg;
+		__entry->len = len;
+	),
+	TP_printk("dev=%s buf=%u msg=%u len=%u", __get_str(dev), __entry->buf,
+		  __entry->msg, __entry->len)
+);
+
+TRACE_EVENT(tinydrm_spi_complete,
+	TP_PROTO(struct drm_device *drm, unsigned int buf, unsigned int pending),
+	TP_ARGS(drm, buf, pending),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(drm->dev))
+		__field(unsigned int, buf)
+		__field(unsigned int, pending)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(drm->dev));
+		__entry->buf = buf;
+		__entry->pending = pending;
+	),
+	TP_printk("dev=%s buf=%u pending=%u", __get_str(dev), __entry->buf,
+		  __entry->pending)
+);
+
+/* A frame was replaced by a newer one before it was flushed */
+TRACE_EVENT(tinydrm_frame_dropped,
+	TP_PROTO(struct drm_device *drm, u32 fb_id, u64 dropped),
+	TP_ARGS(drm, fb_id, dropped),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(drm->dev))
+		__field(u32, fb_id)
+		__field(u64, dropped)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(drm->dev));
+		__entry->fb_id = fb_id;
+		__entry->dropped = dropped;
+	),
+	TP_printk("dev=%s fb=%u dropped=%llu", __get_str(dev), __entry->fb_id,
+		  __entry->dropped)
+);
+
+#endif /* __TINYDRM_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE tinydrm-trace
+#include <trace/define_trace.h>